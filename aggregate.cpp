@@ -0,0 +1,68 @@
+// Prints the results that the processes of a workload added to a shared counter region with the
+// pintool's -aggregate knob, as one report in the same format as the pintool's output.
+#include "aggregate.h"
+
+using std::cerr;
+using std::string;
+using std::endl;
+
+static int Usage()
+{
+    cerr << "This program prints the results aggregated over the processes of a workload\n";
+    cerr << "usage: aggregate -region FILE [-outfile FILE] [-remove 0|1]\n";
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    string region_file;
+    string output_file = "aggregate.out";
+    bool remove = false;
+
+    for(int i = 1; i < argc; i += 2){
+        if(i + 1 >= argc){ return Usage(); }
+        string knob = argv[i];
+        string value = argv[i + 1];
+        if(knob == "-region"){ region_file = value; }
+        else if(knob == "-outfile"){ output_file = value; }
+        else if(knob == "-remove"){ remove = strtoul(value.c_str(), NULL, 0); }
+        else { return Usage(); }
+    }
+    if(region_file.empty()){ return Usage(); }
+
+    int fd = open(region_file.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || (UINT64) st.st_size < sizeof(AGG_REGION)){
+        cerr << "Cannot open aggregate file " << region_file << endl;
+        return -1;
+    }
+    const AGG_REGION* region = (const AGG_REGION*) mmap(NULL, sizeof(AGG_REGION), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(region == MAP_FAILED || memcmp(region->magic, AGG_MAGIC, sizeof(region->magic)) != 0
+       || region->version != AGG_VERSION || region->stats_bytes != sizeof(VPU_STATS)){
+        cerr << region_file << ": not an aggregate file of this build" << endl;
+        return -1;
+    }
+
+    //The VPUs only describe the configurations, their tables are never used
+    std::vector<VPU*> vpus;
+    std::vector<VPU_STATS> stats(region->vpus);
+    for(UINT32 v = 0; v < region->vpus; v++){
+        vpus.push_back(new VPU(region->configs[v], false));
+        memcpy(&stats[v], (const void*) region->stats[v], sizeof(VPU_STATS));
+    }
+    UINT64 prev_per_category[CATEGORIES];
+    UINT64 hit_per_category[CATEGORIES];
+    for(UINT32 i = 0; i < CATEGORIES; i++){
+        prev_per_category[i] = region->prev_per_category[i];
+        hit_per_category[i] = region->hit_per_category[i];
+    }
+
+    std::ofstream out(output_file.c_str(), std::ios_base::app);
+    out << "Processes| " << region->processes << endl;
+    out << "Instruction total| " << region->insts_executed << endl;
+    print_vpu_results(out, vpus, stats, prev_per_category, hit_per_category);
+
+    if(remove){ unlink(region_file.c_str()); }
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Shared counter region: lets every process of a multi-process workload add its results to one
+// file mapped MAP_SHARED (for example under /dev/shm), written by the pintool's -aggregate knob
+// and printed by the aggregate program. No per process output files have to be merged afterwards.
+//
+// The region is an AGG_REGION. The first process to open the file lays it out and sets ready,
+// the others wait for that (at most AGG_WAIT_SECONDS, in case the creator died or the file is a
+// stale one of another layout) and check that they simulate the same configurations. Every counter
+// is added with an atomic add, so processes can finish at the same time.
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <vector>
+#include "vpu.h"
+
+#define AGG_MAGIC "VPUAGGR"
+#define AGG_VERSION 2
+#define AGG_MAX_VPUS 64
+#define AGG_STAT_WORDS (sizeof(VPU_STATS) / sizeof(UINT64))
+#define AGG_WAIT_SECONDS 10
+
+class AGG_REGION {
+public:
+  char magic[8];
+  UINT32 version;
+  UINT32 vpus;
+  UINT32 stats_bytes;     // sizeof(VPU_STATS) of the tool that laid the region out
+  volatile UINT32 ready;  // set once the fields above are written
+  volatile UINT64 processes;       // processes that added their results
+  volatile UINT64 insts_executed;
+  volatile UINT64 prev_per_category[CATEGORIES];
+  volatile UINT64 hit_per_category[CATEGORIES];
+  VPU_CONFIG configs[AGG_MAX_VPUS];
+  volatile UINT64 stats[AGG_MAX_VPUS][AGG_STAT_WORDS]; // VPU_STATS, seen as UINT64 counters
+};
+
+// Map the region in path, laying it out for vpus if the file is new. Returns an error message,
+// empty on success.
+inline std::string agg_attach(const std::string& path, const std::vector<VPU*>& vpus, AGG_REGION*& region){
+    if(vpus.size() > AGG_MAX_VPUS){ return "Too many configurations to aggregate"; }
+    bool created = true;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+    if(fd < 0){
+        created = false;
+        fd = open(path.c_str(), O_RDWR);
+    }
+    if(fd < 0 || (created && ftruncate(fd, sizeof(AGG_REGION)) != 0)){ return "Cannot open aggregate file " + path; }
+    //the creator may not have sized the file yet
+    time_t deadline = time(NULL) + AGG_WAIT_SECONDS;
+    struct stat st;
+    while(fstat(fd, &st) == 0 && (UINT64) st.st_size < sizeof(AGG_REGION)){
+        if(time(NULL) > deadline){
+            close(fd);
+            return path + ": never sized by its creator (stale file of another build, or the creator died)";
+        }
+        sched_yield();
+    }
+    region = (AGG_REGION*) mmap(NULL, sizeof(AGG_REGION), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(region == MAP_FAILED){ return "Cannot map aggregate file " + path; }
+
+    if(created){
+        //the file is zero filled, only the layout is written
+        memcpy(region->magic, AGG_MAGIC, sizeof(region->magic));
+        region->version = AGG_VERSION;
+        region->vpus = vpus.size();
+        region->stats_bytes = sizeof(VPU_STATS);
+        for(UINT32 v = 0; v < vpus.size(); v++){ region->configs[v] = vpus[v]->config; }
+        __sync_synchronize();
+        region->ready = 1;
+    }
+    while(!region->ready){
+        if(time(NULL) > deadline){
+            munmap(region, sizeof(AGG_REGION));
+            region = NULL;
+            return path + ": never laid out by its creator (stale file of another build, or the creator died)";
+        }
+        sched_yield();
+    }
+    if(memcmp(region->magic, AGG_MAGIC, sizeof(region->magic)) != 0 || region->version != AGG_VERSION
+       || region->stats_bytes != sizeof(VPU_STATS)){
+        return path + ": not an aggregate file of this build";
+    }
+    if(region->vpus != vpus.size()){ return path + ": aggregates other configurations"; }
+    for(UINT32 v = 0; v < vpus.size(); v++){
+        if(config_string(region->configs[v]) != config_string(vpus[v]->config)){ return path + ": aggregates other configurations"; }
+    }
+    return "";
+}
+
+// Add one process's results: insts instructions, the value locality per category and stats[v]
+// for configuration v
+inline void agg_add(AGG_REGION* region, UINT64 insts, const UINT64 prev_per_category[], const UINT64 hit_per_category[],
+                    const std::vector<VPU_STATS>& stats){
+    __sync_fetch_and_add(&region->insts_executed, insts);
+    for(UINT32 i = 0; i < CATEGORIES; i++){
+        __sync_fetch_and_add(&region->prev_per_category[i], prev_per_category[i]);
+        __sync_fetch_and_add(&region->hit_per_category[i], hit_per_category[i]);
+    }
+    for(UINT32 v = 0; v < stats.size() && v < region->vpus; v++){
+        const UINT64* words = (const UINT64*) &stats[v];
+        for(UINT32 w = 0; w < AGG_STAT_WORDS; w++){
+            if(words[w]){ __sync_fetch_and_add(&region->stats[v][w], words[w]); }
+        }
+    }
+    __sync_fetch_and_add(&region->processes, 1);
+}
+
+#endif
@@ -0,0 +1,146 @@
+// Small deterministic workloads for the pintool benchmark suite (run-bench.bash). Each kernel
+// stands for one kind of code the VPU sees in real programs, runs in well under a second natively
+// and prints a checksum, so a run that computes something else is noticed.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// xorshift64, so every run builds the same data
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+static inline uint64_t next_random(){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Follow a linked list laid out in a random order: loads whose addresses depend on the last load
+static uint64_t pointer_chase(uint64_t scale){
+    const uint64_t nodes = 1 << 16;
+    std::vector<uint32_t> next(nodes);
+    std::vector<uint32_t> order(nodes);
+    for(uint32_t i = 0; i < nodes; i++){ order[i] = i; }
+    for(uint32_t i = nodes - 1; i > 0; i--){ std::swap(order[i], order[next_random() % (i + 1)]); }
+    for(uint32_t i = 0; i < nodes; i++){ next[order[i]] = order[(i + 1) % nodes]; }
+    uint64_t sum = 0;
+    uint32_t n = order[0];
+    for(uint64_t i = 0; i < scale * 600000; i++){
+        n = next[n];
+        sum += n;
+    }
+    return sum;
+}
+
+// Sum an array at a few strides: loads whose values follow a pattern
+static uint64_t strided(uint64_t scale){
+    const uint64_t elems = 1 << 18;
+    std::vector<int64_t> a(elems);
+    for(uint64_t i = 0; i < elems; i++){ a[i] = i * 3 + (i & 7); }
+    uint64_t sum = 0;
+    static const uint64_t strides[] = {1, 8, 64};
+    for(uint64_t r = 0; r < scale * 3; r++){
+        for(uint32_t s = 0; s < 3; s++){
+            for(uint64_t i = 0; i < elems; i += strides[s]){ sum += a[i]; }
+        }
+    }
+    return sum;
+}
+
+// Jacobi iterations of a 5 point stencil on doubles: float registers
+static uint64_t stencil(uint64_t scale){
+    const uint64_t n = 256;
+    std::vector<double> grid(n * n, 0.0);
+    std::vector<double> out(n * n, 0.0);
+    for(uint64_t i = 0; i < n; i++){ grid[i] = 1.0; } //hot top edge
+    for(uint64_t it = 0; it < scale * 12; it++){
+        for(uint64_t y = 1; y < n - 1; y++){
+            for(uint64_t x = 1; x < n - 1; x++){
+                out[y * n + x] = 0.25 * (grid[(y - 1) * n + x] + grid[(y + 1) * n + x] + grid[y * n + x - 1] + grid[y * n + x + 1]);
+            }
+        }
+        for(uint64_t i = 0; i < n; i++){ out[i] = grid[i]; }
+        grid.swap(out);
+    }
+    double sum = 0;
+    for(uint64_t i = 0; i < n * n; i++){ sum += grid[i]; }
+    uint64_t bits;
+    memcpy(&bits, &sum, sizeof(bits));
+    return bits;
+}
+
+// Insert into and look up an open addressing hash table: hashing arithmetic and irregular loads
+static uint64_t hash(uint64_t scale){
+    const uint64_t slots = 1 << 16;
+    std::vector<uint64_t> keys(slots, 0);
+    std::vector<uint64_t> values(slots, 0);
+    uint64_t found = 0;
+    for(uint64_t i = 0; i < scale * 300000; i++){
+        uint64_t key = (next_random() % (slots / 2)) + 1;
+        uint64_t h = (key * 0x9E3779B97F4A7C15ULL) >> 48;
+        while(keys[h] && keys[h] != key){ h = (h + 1) & (slots - 1); }
+        if(keys[h] == key){
+            found += values[h];
+            values[h]++;
+        } else {
+            keys[h] = key;
+            values[h] = 1;
+        }
+    }
+    return found;
+}
+
+// Data dependent branches and short integer chains: Collatz steps of consecutive numbers
+static uint64_t branchy(uint64_t scale){
+    uint64_t steps = 0;
+    for(uint64_t start = 1; start < scale * 60000; start++){
+        uint64_t x = start;
+        while(x != 1){
+            if(x & 1){ x = 3 * x + 1; }
+            else if(x & 2){ x >>= 1; }
+            else { x >>= 2; }
+            steps++;
+        }
+    }
+    return steps;
+}
+
+struct KERNEL {
+    const char* name;
+    uint64_t (*run)(uint64_t scale);
+};
+
+static const KERNEL KERNELS[] = {
+    {"pointer_chase", pointer_chase},
+    {"strided", strided},
+    {"stencil", stencil},
+    {"hash", hash},
+    {"branchy", branchy},
+};
+static const uint32_t NUM_KERNELS = sizeof(KERNELS)/sizeof(KERNELS[0]);
+
+static int Usage()
+{
+    fprintf(stderr, "This program runs one of the benchmark suite's kernels\n");
+    fprintf(stderr, "usage: benchkernels KERNEL [SCALE]\n");
+    fprintf(stderr, "kernels:");
+    for(uint32_t k = 0; k < NUM_KERNELS; k++){ fprintf(stderr, " %s", KERNELS[k].name); }
+    fprintf(stderr, "\n");
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2 || argc > 3){ return Usage(); }
+    uint64_t scale = (argc == 3) ? strtoull(argv[2], NULL, 0) : 1;
+    for(uint32_t k = 0; k < NUM_KERNELS; k++){
+        if(std::string(argv[1]) == KERNELS[k].name){
+            printf("%s|%llx\n", KERNELS[k].name, (unsigned long long) KERNELS[k].run(scale));
+            return 0;
+        }
+    }
+    return Usage();
+}
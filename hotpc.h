@@ -0,0 +1,238 @@
+// Hot instruction profile: the most executed instructions and the values each of them writes most
+// often, kept in a fixed amount of memory whatever the size of the program. Filled by the pintool
+// with -hot_pcs and printed as the HOT INSTRUCTIONS block.
+//
+// Both levels are space-saving sketches (Metwally, Agrawal and El Abbadi, "Efficient computation
+// of frequent and top-k elements in data streams"). A sketch keeps a fixed number of counters; a
+// key that has none takes the counter with the smallest count and inherits that count as its
+// error, so every key executed more often than 1/capacity of the stream is guaranteed a counter.
+// Only the instructions that hold a counter in the instruction sketch have a value sketch, and a
+// value sketch starts over when its counter passes to another instruction.
+#ifndef HOTPC_H
+#define HOTPC_H
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include "vpu.h"
+
+#define HOT_MAX_VALUES 16
+#define HOT_SLACK 4         // the instruction sketch keeps this many times the counters it reports
+
+// One counter of a space-saving sketch
+class HOT_COUNTER {
+public:
+  UINT64 key;
+  UINT64 count;  // at least the true count of key since it took the counter, at most error more
+  UINT64 error;
+};
+
+// Count key in the value sketch counters[0 .. n), n being small enough to scan
+inline void hot_count_value(HOT_COUNTER* counters, UINT32 n, UINT64 key){
+    UINT32 min = 0;
+    for(UINT32 i = 0; i < n; i++){
+        if(counters[i].key == key && counters[i].count){
+            counters[i].count++;
+            return;
+        }
+        if(counters[i].count < counters[min].count){ min = i; }
+    }
+    counters[min].key = key;
+    counters[min].error = counters[min].count;
+    counters[min].count++;
+}
+
+// Instruction sketch of one thread, with the value sketch of each of its counters. Counters are
+// found by a linear probing hash of the instruction address, and kept in a min-heap on their
+// count so the one to replace is always at the top.
+class HOT_PROFILE {
+public:
+  UINT32 capacity;       // counters
+  UINT32 values;         // counters of each value sketch
+  UINT32 used;
+  HOT_COUNTER* pcs;      // capacity counters, a counter keeps its slot for the whole run
+  HOT_COUNTER* value_counts; // capacity * values, the value sketch of pcs[s] starts at s * values
+  UINT32* heap;          // slots, smallest count first
+  UINT32* heap_pos;      // position of each slot in heap
+  UINT32* index;         // hash of the address to slot + 1, 0 = empty
+  UINT32 index_mask;
+
+  HOT_PROFILE(UINT32 capacity, UINT32 values) : capacity(capacity), values(values), used(0) {
+    pcs = new HOT_COUNTER[capacity]();
+    value_counts = new HOT_COUNTER[(UINT64) capacity * values]();
+    heap = new UINT32[capacity];
+    heap_pos = new UINT32[capacity];
+    UINT32 index_size = 1;
+    while(index_size < capacity * 2){ index_size <<= 1; }
+    index = new UINT32[index_size]();
+    index_mask = index_size - 1;
+  }
+
+  ~HOT_PROFILE(){
+    delete[] pcs;
+    delete[] value_counts;
+    delete[] heap;
+    delete[] heap_pos;
+    delete[] index;
+  }
+
+  UINT64 memory_bytes() const {
+    return (UINT64) capacity * (sizeof(HOT_COUNTER) * (1 + values) + 2 * sizeof(UINT32)) + (index_mask + 1) * sizeof(UINT32);
+  }
+
+  // Forget everything counted so far
+  void clear(){
+    used = 0;
+    memset(pcs, 0, capacity * sizeof(HOT_COUNTER));
+    memset(value_counts, 0, (UINT64) capacity * values * sizeof(HOT_COUNTER));
+    memset(index, 0, (index_mask + 1) * sizeof(UINT32));
+  }
+
+  // Count one execution of ins_ptr writing value
+  void count(UINT64 ins_ptr, UINT64 value){
+    UINT32 s = slot_of(ins_ptr);
+    hot_count_value(value_counts + (UINT64) s * values, values, value);
+  }
+
+private:
+  UINT32 hash(UINT64 key) const { return (UINT32) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & index_mask; }
+
+  // Slot counting ins_ptr, taking one over if it has none
+  UINT32 slot_of(UINT64 ins_ptr){
+    UINT32 h = hash(ins_ptr);
+    for(; index[h]; h = (h + 1) & index_mask){
+        UINT32 s = index[h] - 1;
+        if(pcs[s].key == ins_ptr){
+            pcs[s].count++;
+            sift_down(heap_pos[s]);
+            return s;
+        }
+    }
+    UINT32 s;
+    if(used < capacity){
+        s = used;
+        heap[used] = s;
+        heap_pos[s] = used;
+        used++;
+        pcs[s].error = 0;
+        pcs[s].count = 0;
+        sift_up(heap_pos[s]);
+    } else {
+        s = heap[0];
+        unindex(pcs[s].key);
+        pcs[s].error = pcs[s].count;
+        memset(value_counts + (UINT64) s * values, 0, values * sizeof(HOT_COUNTER));
+        h = hash(ins_ptr);
+        while(index[h]){ h = (h + 1) & index_mask; } //unindex may have moved the free spot
+    }
+    index[h] = s + 1;
+    pcs[s].key = ins_ptr;
+    pcs[s].count++;
+    sift_down(heap_pos[s]);
+    return s;
+  }
+
+  // Take key out of the index, moving later entries of its probe run back into the gap
+  void unindex(UINT64 key){
+    UINT32 h = hash(key);
+    while(pcs[index[h] - 1].key != key){ h = (h + 1) & index_mask; }
+    UINT32 gap = h;
+    for(h = (h + 1) & index_mask; index[h]; h = (h + 1) & index_mask){
+        UINT32 home = hash(pcs[index[h] - 1].key);
+        //move the entry unless its home lies cyclically in (gap, h]
+        if(((h - home) & index_mask) >= ((h - gap) & index_mask)){
+            index[gap] = index[h];
+            gap = h;
+        }
+    }
+    index[gap] = 0;
+  }
+
+  void swap(UINT32 a, UINT32 b){
+    UINT32 t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    heap_pos[heap[a]] = a;
+    heap_pos[heap[b]] = b;
+  }
+
+  void sift_up(UINT32 i){
+    while(i && pcs[heap[i]].count < pcs[heap[(i - 1) / 2]].count){
+        swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+  }
+
+  void sift_down(UINT32 i){
+    for(;;){
+        UINT32 min = i;
+        UINT32 l = 2 * i + 1;
+        if(l < used && pcs[heap[l]].count < pcs[heap[min]].count){ min = l; }
+        if(l + 1 < used && pcs[heap[l + 1]].count < pcs[heap[min]].count){ min = l + 1; }
+        if(min == i){ return; }
+        swap(i, min);
+        i = min;
+    }
+  }
+};
+
+// An instruction of the report, merged over the profiles of all threads
+class HOT_PC {
+public:
+  UINT64 ins_ptr;
+  UINT64 count;
+  UINT64 error;
+  std::vector<HOT_COUNTER> top_values; // most frequent first
+  HOT_PC() : ins_ptr(0), count(0), error(0) {}
+  // executions that wrote the most frequent value
+  UINT64 invariant() const { return top_values.empty() ? 0 : top_values[0].count; }
+};
+
+inline bool hot_more_values(const HOT_COUNTER& a, const HOT_COUNTER& b){
+    return a.count != b.count ? a.count > b.count : a.key < b.key;
+}
+
+inline bool hot_more_invariant(const HOT_PC& a, const HOT_PC& b){
+    if(a.invariant() != b.invariant()){ return a.invariant() > b.invariant(); }
+    return a.count != b.count ? a.count > b.count : a.ins_ptr < b.ins_ptr;
+}
+
+// The instructions of profiles, most executions of their most frequent value first. Counts of an
+// instruction or value that lost its counter in some threads are only those of the other threads.
+inline std::vector<HOT_PC> hot_merge(const std::vector<const HOT_PROFILE*>& profiles){
+    std::map<UINT64, HOT_PC> merged;
+    std::map<UINT64, std::map<UINT64, HOT_COUNTER> > values;
+    for(UINT32 p = 0; p < profiles.size(); p++){
+        const HOT_PROFILE* profile = profiles[p];
+        for(UINT32 s = 0; s < profile->used; s++){
+            HOT_PC& pc = merged[profile->pcs[s].key];
+            pc.ins_ptr = profile->pcs[s].key;
+            pc.count += profile->pcs[s].count;
+            pc.error += profile->pcs[s].error;
+            std::map<UINT64, HOT_COUNTER>& pc_values = values[pc.ins_ptr];
+            const HOT_COUNTER* counters = profile->value_counts + (UINT64) s * profile->values;
+            for(UINT32 i = 0; i < profile->values; i++){
+                if(!counters[i].count){ continue; }
+                HOT_COUNTER& c = pc_values[counters[i].key];
+                c.key = counters[i].key;
+                c.count += counters[i].count;
+                c.error += counters[i].error;
+            }
+        }
+    }
+
+    std::vector<HOT_PC> hot;
+    for(std::map<UINT64, HOT_PC>::iterator i = merged.begin(); i != merged.end(); i++){
+        HOT_PC& pc = i->second;
+        std::map<UINT64, HOT_COUNTER>& pc_values = values[pc.ins_ptr];
+        for(std::map<UINT64, HOT_COUNTER>::iterator v = pc_values.begin(); v != pc_values.end(); v++){
+            pc.top_values.push_back(v->second);
+        }
+        std::sort(pc.top_values.begin(), pc.top_values.end(), hot_more_values);
+        hot.push_back(pc);
+    }
+    std::sort(hot.begin(), hot.end(), hot_more_invariant);
+    return hot;
+}
+
+#endif
@@ -1,20 +1,25 @@
 #include <unistd.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstdlib>
 #include "pin.H"
+#define VPU_HAVE_PIN_TYPES
+#include "vpu.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "aggregate.h"
+#include "hotpc.h"
 #include <set>
 #include <map> 
 #include <list>
+#include <deque>
 #include <algorithm>
 
 //Disable any instrumentation and dump all the instructions in the test program that we care about
 // ie. instuctions that write to a register.  
 //#define DUMP_INSTS_USED
 
-//turn on printf debug messages
-//#define PRINTF
-
 using std::cout;
 using std::cerr;
 using std::string;
@@ -30,44 +35,6 @@ std::ostream * out = &cerr;
                             || t == XED_CATEGORY_MISC  || t ==  XED_CATEGORY_SETCC || t == XED_CATEGORY_SHIFT \
                             || t == XED_CATEGORY_SSE || t == XED_CATEGORY_X87_ALU )
 
-// Create function for x^y
-UINT32 POW(UINT32 x, UINT32 y) {
-  UINT32 x_y = 1;
-  for (UINT32 i = 0; i < y; i++) { x_y *= x ; }
-  return x_y;
-};
-
-// Category for instruction
-enum INST_CAT {
-  UNKNOWN,
-  I_PURE_LOAD,
-  I_LOAD_ARITH,
-  I_PURE_ARITH,
-  I_ARITH_1OP,
-  I_ARITH_2OP,
-  I_REG_MOV,
-  F_PURE_LOAD,
-  F_LOAD_ARITH,
-  F_PURE_ARITH,
-  F_REG_MOVE,
-};
-
-std::string INST_CAT_s[] = {
-  "UNKNOWN",
-  "I_PURE_LOAD",
-  "I_LOAD_ARITH",
-  "I_PURE_ARITH",
-  "I_ARITH_1OP",
-  "I_ARITH_2OP",
-  "I_REG_MOV",
-  "F_PURE_LOAD",
-  "F_LOAD_ARITH",
-  "F_PURE_ARITH",
-  "F_REG_MOVE"
-};
-
-UINT8 CATEGORIES = sizeof(INST_CAT_s)/sizeof(INST_CAT_s[0]);
-
 /* ===================================================================== */
 /* Commandline Switches */
 /* ===================================================================== */
@@ -79,10 +46,10 @@ KNOB<BOOL>   KnobPid(KNOB_MODE_WRITEONCE,                "pintool",
                             "pid", "0", "Append pid to output");
 
 KNOB<UINT64> KnobLimit(KNOB_MODE_WRITEONCE,        "pintool",
-                            "inst_limit", "1000000000", "Quit after executing x number of instructions");
+                            "inst_limit", "1000000000", "Write the results after executing x number of instructions and let the program finish natively");
 
 KNOB<string> KnobInstCat(KNOB_MODE_WRITEONCE,         "pintool",
-                            "inst_cat", "ALL", "What category of instructions?");
+                            "inst_cat", "ALL", "Instruction categories to simulate, ALL or a comma separated list such as I_PURE_LOAD,F_PURE_LOAD");
 
 KNOB<UINT64> KnobTableSize(KNOB_MODE_WRITEONCE,        "pintool",
                             "size", "8", "Size of Value Prediction table in bits. Total length = 2**size");     
@@ -97,115 +64,152 @@ KNOB<UINT64> KnobHistDepth(KNOB_MODE_WRITEONCE,        "pintool",
                             "HistDepth", "1", "Value history size");      
 
 KNOB<UINT64> KnobVictimCache(KNOB_MODE_WRITEONCE,        "pintool",
-                            "VictimCache", "0", "Value history size");      
+                            "VictimCache", "0", "Entries in the victim cache that holds VPT entries evicted by conflicts (0 = none)");      
 
-enum RT{freg=1, i8reg=2, i16reg=3, i32reg=4, i64reg=5}; 
-#define IS_FLOAT(type) ((type == freg))
-std::string rt_name[] = {"", "Float Reg", "8 Bit Int", "16 Bit Int", "32 Bit Int", "64 Bit Int"};
-std::set<REG> allreg;
-std::map<REG, RT> regtype;
+KNOB<string> KnobPredType(KNOB_MODE_WRITEONCE,        "pintool",
+                            "PredType", "last", "Value predictor: last, stride, 2delta, fcm or hybrid (2delta and fcm with a per entry chooser)");
 
-UINT8 ZEROBUF[] = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+KNOB<UINT64> KnobFCMorder(KNOB_MODE_WRITEONCE,        "pintool",
+                            "FCMorder", "2", "Number of previous values forming the context of the fcm and hybrid predictors");
 
-class regval{ 
-public:
-    //enum RVT{FLOAT, INT} tag; //float type or int type? 
-    RT real_type; //type?
-    union{
-        UINT8 float_store[MAX_BYTES_PER_PIN_REG]; // to store any float (some floats can be loooooooomg)
-        UINT64 value; //to store any int type 
-    };
-    regval(){}
-    regval(void* p_to_val, RT type){ 
-        if(IS_FLOAT(type)){
-            value = *((UINT64*) p_to_val);
-        }else{
-            memcpy(float_store, p_to_val, MAX_BYTES_PER_PIN_REG);
-        }
-        real_type = type;
-    } 
-    bool operator==(const regval& other) const {
-        assert(real_type == other.real_type);
-        switch(real_type){
-            case freg:
-                return (memcmp(float_store, other.float_store, MAX_BYTES_PER_PIN_REG) == 0);
-                break;
-            case i64reg:
-                return (value == other.value);
-                break;
-            case i32reg:
-                return ((value&0xFFFFFFFF) == (other.value&0xFFFFFFFF));
-                break;
-            case i16reg:
-                return ((value&0xFFFF) == (other.value&0xFFFF));
-                break;
-            case i8reg:
-                return ((value&0xFF) == (other.value&0xFF));
-                break;
-            default:
-                assert(false);
-        }
-    }
+KNOB<UINT64> KnobFingerprint(KNOB_MODE_WRITEONCE,        "pintool",
+                            "Fingerprint", "0", "1 = keep 64 bit fingerprints of float values in the value histories instead of the values");
 
-}; 
+KNOB<UINT64> KnobVPTways(KNOB_MODE_WRITEONCE,        "pintool",
+                            "VPTways", "1", "VPT associativity, a power of 2 up to 16 (1 = direct mapped)");
 
+KNOB<string> KnobVPTrepl(KNOB_MODE_WRITEONCE,        "pintool",
+                            "VPTrepl", "lru", "Replacement within a VPT set: lru, plru or random");
 
-// cout << a << endl
-std::ostream& operator<<(std::ostream &strm, const regval &a) {
-    switch(a.real_type){
-        case freg:
-            strm << "FLOAT(";
-            for(int i = MAX_BYTES_PER_PIN_REG; i >= 0; i--){
-                strm <<std::setfill('0') << std::setw(2) << std::hex << (UINT32) (a.float_store[i]);
-            }
-            strm  << ")";
-            return strm;
-            break;
-        case i64reg:
-            return strm << "INT(" << a.value << ")"; 
-            break;
-        case i32reg:
-            return strm << "INT(" << (a.value&0xFFFFFFFF) << ")"; 
-            break;
-        case i16reg:
-            return strm << "INT(" << (a.value&0xFFFF) << ")"; 
-            break;
-        case i8reg:
-            return strm << "INT(" << (a.value&0xFF) << ")"; 
-            break;
-        default:
-            assert(false);
+KNOB<string> KnobCTindex(KNOB_MODE_WRITEONCE,        "pintool",
+                            "CTindex", "pc", "CT indexing: pc, xor, gshare or tagged");
+
+KNOB<string> KnobConfig(KNOB_MODE_APPEND,        "pintool",
+                            "config", "", "Extra VPU configuration to simulate, e.g. size=10,CTsize=10,CTbits=2 (repeatable)");
+
+KNOB<string> KnobConfigFile(KNOB_MODE_WRITEONCE,        "pintool",
+                            "config_file", "", "File with one VPU configuration per line, same format as -config");
+
+KNOB<string> KnobTraceOut(KNOB_MODE_WRITEONCE,        "pintool",
+                            "trace_out", "", "Also record the value stream to this trace file for the replay simulator");
+
+KNOB<string> KnobPredictor(KNOB_MODE_WRITEONCE,        "pintool",
+                            "predictor", "private", "private: each thread has its own VPUs, shared: all threads update the same VPUs");
+
+KNOB<UINT64> KnobSampleFF(KNOB_MODE_WRITEONCE,        "pintool",
+                            "sample_ff", "0", "Instructions to fast-forward before each sampled window (0 = simulate every instruction)");
+
+KNOB<UINT64> KnobSampleWarmup(KNOB_MODE_WRITEONCE,        "pintool",
+                            "sample_warmup", "0", "Instructions each sampled window trains the VPUs before measuring");
+
+KNOB<UINT64> KnobSampleMeasure(KNOB_MODE_WRITEONCE,        "pintool",
+                            "sample_measure", "10000000", "Instructions measured in each sampled window");
+
+KNOB<string> KnobSimPoints(KNOB_MODE_WRITEONCE,        "pintool",
+                            "simpoints", "", "File of instruction counts at which sampled windows start measuring, one per line, instead of -sample_ff");
+
+KNOB<UINT64> KnobInterval(KNOB_MODE_WRITEONCE,        "pintool",
+                            "interval", "0", "Write the statistics of every x number of instructions to interval_out (0 = off)");
+
+KNOB<string> KnobIntervalOut(KNOB_MODE_WRITEONCE,        "pintool",
+                            "interval_out", "intervals.csv", "CSV file for the -interval statistics");
+
+#ifdef PROFILE
+KNOB<UINT64> KnobNativeMs(KNOB_MODE_WRITEONCE,        "pintool",
+                            "native_ms", "0", "Run time of the program without Pin in milliseconds, for the slowdown in the TOOL PROFILE");
+#endif
+
+KNOB<bool> KnobTiming(KNOB_MODE_WRITEONCE,        "pintool",
+                            "timing", "1", "Run the dataflow timing model and report the speedup of every configuration");
+
+KNOB<UINT32> KnobIssueWidth(KNOB_MODE_WRITEONCE,        "pintool",
+                            "issue_width", "4", "Instructions the timing model issues per cycle (0 = unlimited)");
+
+KNOB<UINT32> KnobVPPenalty(KNOB_MODE_WRITEONCE,        "pintool",
+                            "vp_penalty", "10", "Cycles the timing model adds before consumers of a mispredicted value can reissue");
+
+KNOB<UINT32> KnobBufferPages(KNOB_MODE_WRITEONCE,        "pintool",
+                            "buffer_pages", "0", "Pages per thread buffer of written values, simulated in batches on a separate thread (0 = simulate after every instruction)");
+
+KNOB<string> KnobSnapshotOut(KNOB_MODE_WRITEONCE,        "pintool",
+                            "snapshot_out", "", "Save the predictor state and value locality of every instruction to this file at exit");
+
+KNOB<UINT64> KnobSnapshotEvery(KNOB_MODE_WRITEONCE,        "pintool",
+                            "snapshot_every", "0", "Also save the snapshot every x number of instructions (0 = only at exit)");
+
+KNOB<string> KnobSnapshotIn(KNOB_MODE_WRITEONCE,        "pintool",
+                            "snapshot_in", "", "Start from the predictor state saved in this snapshot file instead of empty tables");
+
+KNOB<BOOL>   KnobResume(KNOB_MODE_WRITEONCE,        "pintool",
+                            "resume", "0", "Also carry on the counts of the -snapshot_in run, so the results cover both runs");
+
+KNOB<string> KnobAggregate(KNOB_MODE_WRITEONCE,        "pintool",
+                            "aggregate", "", "Also add the results to this shared counter file, which every process of the workload adds to (print it with aggregate)");
+
+KNOB<UINT32> KnobHotPcs(KNOB_MODE_WRITEONCE,        "pintool",
+                            "hot_pcs", "0", "Report the N hot instructions whose most frequent value is written most often (0 = no report)");
+
+KNOB<UINT32> KnobHotValues(KNOB_MODE_WRITEONCE,        "pintool",
+                            "hot_values", "4", "Most frequent values tracked per hot instruction, up to 16");
+
+KNOB<BOOL>   KnobMemValues(KNOB_MODE_WRITEONCE,        "pintool",
+                            "mem_values", "0", "Also simulate every configuration on load addresses and on store values (a Stream=load and a Stream=store copy of each)");
+
+std::set<REG> allreg;
+std::map<REG, RT> regtype;
+bool inst_cat_enabled[CATEGORIES]; // -inst_cat, indexed by INST_CAT
+
+bool dataflow_timing;               // -timing
+UINT32 issue_width;                 // -issue_width
+UINT32 vp_penalty;                  // -vp_penalty
+std::map<REG, UINT16> df_regs;      // dense DATAFLOW register numbers, by full width register
+
+// DATAFLOW number of the full width register holding r, so eax and rax are the same register
+UINT16 dataflow_reg(REG r){
+    REG full = REG_FullRegName(r);
+    if(!X_IN_Y(full, df_regs)){
+        UINT16 n = df_regs.size();
+        df_regs[full] = (n < DF_REGS) ? n : DF_REGS - 1; //never reached in practice, only times less precisely
     }
+    return df_regs[full];
 }
 
-//global number of instructions executed
-UINT64 insts_executed; 
+class THREAD_DATA;
+class INST_DATA;
+// record_value specialized for the register an instruction writes
+typedef VOID (*RECORD_FUNPTR)(THREAD_DATA* td, ADDRINT ins_ptr, INST_DATA* ins_data, const regval& value_to_write);
+
 //The data in this class are properties of the instruction itself
 // One INST_DATA object is allocated per instruction we care about, which is initialized in the Instruction() function
 // Some statistics regarding the instruction is also kept here.
 class INST_DATA{
 public: 
     //These values are constant once initialized.
-    string disassembly; //INS_Disassemble(ins)
+#ifdef PRINTF
+    string disassembly; //INS_Disassemble(ins), the hot instruction report disassembles only what it prints
+#endif
     UINT32 category; // pretty print using  CATEGORY_StringShort
     UINT32 opcode; // pretty print using OPCODE_StringShort
     UINT32 num_read_reg; //INS_MaxNumRRegs(ins) 
     std::vector<REG> read_regs;  // REG is pin datatype
     REG write_reg;  // output register
     RT datatype; 
-
-    //Below are some statistics and other info about the instructions
-    // these may be modified whenever the instruction is hit
-    UINT64 hit_count; //number of times the instruction has been executed.
-    UINT64 prev_seen; // number of times the data matched previous execution
-    UINT64 pred_success;  // Number of times the instruction is successfully predicted
-    UINT64 pred_failed;   // Number of times the entry is incorrectly predicted
-    UINT64 missed_success; // Capture the number of correct predictions we missed
-    regval last_value_seen;//What's the last value stored to the out register? 
+    UINT16 df_srcs[DF_MAX_SRCS]; // dataflow_reg of read_regs, without the instruction pointer
+    UINT32 df_num_srcs;
+    UINT16 df_dst;               // dataflow_reg of write_reg
+    UINT32 value_bytes; // bytes of the written value that are compared, 8 for ints
+    AFUNPTR analysis;   // value_predict_gr/value_predict_fr instance for write_reg
+    RECORD_FUNPTR record; // record_value instance for write_reg
+
+    UINT32 id; // dense number of this instruction, indexes the per thread INST_LOCALITY tables
     INST_CAT flag; 
+    const SNAPSHOT_INST* saved; // this instruction's record in -snapshot_in, if it has one
+    bool first; // is this the first value the instruction records each time it runs? Marks its trace records
 
     INST_DATA(INS ins){
+#ifdef PRINTF
         disassembly = INS_Disassemble(ins);
+#endif
         category = INS_Category(ins);
         opcode = INS_Opcode(ins);
         num_read_reg = INS_MaxNumRRegs(ins);
@@ -223,47 +227,459 @@ public:
             read_regs.push_back(reg_iterate);
         }
 
-        hit_count = 0; //total number of times this instruction has been executed 
-        prev_seen = 0; //how many times does current value = last_value_seen? Value locality = prev_seen / hit_count
-        pred_success = 0;
-        pred_failed = 0;
-        last_value_seen = regval((void*)ZEROBUF, datatype); 
+        df_num_srcs = 0;
+        FOR_X_IN_Y(r, read_regs){
+            if(*r == REG_INST_PTR || df_num_srcs == DF_MAX_SRCS){ continue; }
+            df_srcs[df_num_srcs++] = dataflow_reg(*r);
+        }
+        df_dst = dataflow_reg(write_reg);
+
+        value_bytes = 8;
+        analysis = NULL;
+        record = NULL;
+        id = 0;
+        saved = NULL;
+        first = true;
         flag = UNKNOWN; //set the flag when registering this instruction if it is and instruction class we are testing
     }
+
+    // The memory operand of ins that mem_flag predicts, bytes wide: the address of its load
+    // (M_LOAD_ADDR) or the value it stores (M_STORE_VALUE). Stores of 16 bytes or more are
+    // compared like float registers of that width.
+    INST_DATA(INS ins, INST_CAT mem_flag, UINT32 bytes){
+#ifdef PRINTF
+        disassembly = INS_Disassemble(ins);
+#endif
+        category = INS_Category(ins);
+        opcode = INS_Opcode(ins);
+        num_read_reg = INS_MaxNumRRegs(ins);
+        write_reg = REG_INVALID_;
+        if(bytes == 1){ datatype = i8reg; }
+        else if(bytes == 2){ datatype = i16reg; }
+        else if(bytes == 4){ datatype = i32reg; }
+        else if(bytes == 8){ datatype = i64reg; }
+        else { datatype = freg; }
+        df_num_srcs = 0; //memory operands are not timed
+        df_dst = 0;
+
+        value_bytes = IS_FLOAT(datatype) ? bytes : 8;
+        analysis = NULL;
+        record = NULL;
+        id = 0;
+        saved = NULL;
+        first = false; //set by InstrumentMemory
+        flag = mem_flag;
+    }
 };
 std::map<ADDRINT, INST_DATA*> inst_data;
+std::vector<INST_DATA*> inst_by_id;
+// -mem_values: the INST_DATA of the load address and of the store value of each instruction,
+// apart from inst_data as an instruction can have a register output as well
+std::map<ADDRINT, INST_DATA*> load_addr_data;
+std::map<ADDRINT, INST_DATA*> store_value_data;
+bool streams[VP_STREAMS];           // VP_STREAMs some VPU predicts
+bool mem_streams;                   // and whether any of them is a memory stream
+
+//Value locality statistics of one instruction, as seen by one thread
+class INST_LOCALITY{
+public:
+    UINT64 hit_count; //number of times the instruction has been executed.
+    UINT64 prev_seen; // number of times the data matched previous execution
+    UINT64 last_value_seen; //What's the last int value stored to the out register? 
+    UINT8* last_wide_seen;  //and the last float value, allocated at the first execution of a float instruction
+};
 
-/* ===================================================================== */
-/* Value Prediction Unit                                                 */
-/* ===================================================================== */
-UINT8 VPT_BITS;      // Number of bits to use as VPT address
-UINT32 VPT_ENTRIES;  // Length of VPT table
-UINT32 VPT_MASK;     // Mask for VPT address table
-UINT32 CT_ENTRIES;   // Length of Classification Table
-UINT32 CT_MASK;       // Bitmask for Classification table entries
-UINT8 CT_BITS;       // Size of prediction in bits
-UINT8 CT_MAX;        // Size of prediction
-UINT8 CT_PRED_TH;    // Threshold to use for prediction CT_Max/2
-UINT8 CT_REP_TH;     // Threshold to replace value history
-bool CT_PERF;        // CT is perfect - never fails
-
-
-// Entry for Value Prediction Table
-class VPT_ENTRY {
+#define LOCALITY_CHUNK_BITS 12
+#define LOCALITY_CHUNK_SIZE (1 << LOCALITY_CHUNK_BITS)
+#define LOCALITY_CHUNKS 4096 // at most 16M instrumented instructions
+#define INSTS_BATCH 65536    // most instructions a thread counts before adding them to insts_flushed
+
+// Everything a thread of the target program updates in value_predict, so that threads never
+// write to the same counters. Reached through Pin TLS, and kept after the thread exits so
+// PrintResults can merge it.
+class THREAD_DATA{
+public:
+    UINT64 insts_executed; //number of instructions this thread executed, not counting insts_batch
+    UINT64 insts_batch;    //instructions counted since the last flush to insts_flushed
+    UINT64 batch_limit;    //flush once insts_batch reaches this, at most INSTS_BATCH and never past inst_limit
+    std::vector<VPU*> vpus;  // this thread's own VPUs, or the shared ones
+    std::vector<VPU_STATS> stats; // this thread's prediction statistics for each of vpus
+    DATAFLOW* base_timing;   // -timing: this thread's instructions without value prediction
+    std::vector<DATAFLOW*> timing; // and with the predictions of each of vpus
+    INST_LOCALITY* locality[LOCALITY_CHUNKS]; //indexed by INST_DATA::id, allocated a chunk at a time
+    UINT64 prev_per_category[CATEGORIES]; // the INST_LOCALITY counts summed per instruction category
+    UINT64 hit_per_category[CATEGORIES];
+    HOT_PROFILE* hot;        // -hot_pcs: this thread's hot instructions and their values, NULL otherwise
+#ifdef PROFILE
+    UINT64 cycles[PROF_PHASES]; // time spent in the phases outside the VPUs
+#endif
+
+    //Only used with -buffer_pages
+    std::vector<VOID*> free_buffers; // buffers the consumer is done with, guarded by buffers_lock
+    PIN_SEMAPHORE buffer_freed;      // set when a buffer is added to free_buffers
+    VOID* filling;       // the buffer Pin is filling, its records end at the first without an INST_DATA
+    UINT8* wide_values;  // ring of float register values, MAX_BYTES_PER_PIN_REG bytes per slot
+    ADDRINT wide_slots;  // number of slots in wide_values
+    ADDRINT wide_next;   // slot the next float value goes to
+
+    ADDRINT store_ea;    // -mem_values: address the store being executed writes, saved before it is read back after it
+
+    THREAD_DATA() : insts_executed(0), insts_batch(0), batch_limit(0), base_timing(NULL), hot(NULL), filling(NULL), wide_values(NULL), wide_slots(0), wide_next(0), store_ea(0) {
+        memset(locality, 0, sizeof(locality));
+        memset(prev_per_category, 0, sizeof(prev_per_category));
+        memset(hit_per_category, 0, sizeof(hit_per_category));
+#ifdef PROFILE
+        memset(cycles, 0, sizeof(cycles));
+#endif
+        PIN_SemaphoreInit(&buffer_freed);
+    }
+
+    // The locality of ins_data, whose float values are compared over value_bytes bytes
+    INST_LOCALITY& get_locality(INST_DATA* ins_data, UINT32 value_bytes){
+        INST_LOCALITY*& chunk = locality[ins_data->id >> LOCALITY_CHUNK_BITS];
+        if(!chunk){ chunk = new INST_LOCALITY[LOCALITY_CHUNK_SIZE](); }
+        INST_LOCALITY& loc = chunk[ins_data->id & (LOCALITY_CHUNK_SIZE - 1)];
+        if(!loc.hit_count && IS_FLOAT(ins_data->datatype) && !loc.last_wide_seen){
+            loc.last_wide_seen = (UINT8*) calloc(1, value_bytes); //starts out as zero, same as ints
+        }
+        if(!loc.hit_count && ins_data->saved){ loc.last_value_seen = ins_data->saved->last_value; }
+        return loc;
+    }
+
+    // Start counting from zero, keeping the last values seen
+    VOID reset(){
+        insts_executed = 0;
+        insts_batch = 0;
+        for(UINT32 v = 0; v < stats.size(); v++){ stats[v] = VPU_STATS(); }
+        if(base_timing){
+            delete base_timing;
+            base_timing = new DATAFLOW();
+            for(UINT32 v = 0; v < timing.size(); v++){
+                delete timing[v];
+                timing[v] = new DATAFLOW();
+            }
+        }
+        for(UINT32 c = 0; c < LOCALITY_CHUNKS; c++){
+            if(!locality[c]){ continue; }
+            for(UINT32 i = 0; i < LOCALITY_CHUNK_SIZE; i++){
+                locality[c][i].hit_count = 0;
+                locality[c][i].prev_seen = 0;
+            }
+        }
+        memset(prev_per_category, 0, sizeof(prev_per_category));
+        memset(hit_per_category, 0, sizeof(hit_per_category));
+        if(hot){ hot->clear(); }
+#ifdef PROFILE
+        memset(cycles, 0, sizeof(cycles));
+#endif
+    }
+};
+
+TLS_KEY thread_key;
+REG thread_reg;                     // holds the THREAD_DATA* of every thread, so analysis routines get it as an argument
+PIN_LOCK threads_lock;              // guards threads and vpus_taken
+std::vector<THREAD_DATA*> threads;  // every thread seen so far
+bool shared_predictor;              // -predictor shared
+bool vpus_taken;                    // the first thread uses vpus for its private VPUs
+volatile UINT64 insts_flushed;      // instructions executed by all threads, in batches
+volatile bool limit_hit;            // a thread passed inst_limit, set once
+
+PIN_LOCK trace_lock;                // threads take turns appending to the trace
+PIN_LOCK print_lock;
+
+// One record of a thread's value buffer (-buffer_pages), written by INS_InsertFillBuffer
+class BUFFER_RECORD{
+public:
+    ADDRINT ins_ptr;
+    INST_DATA* ins_data;
+    ADDRINT value; //the register value, or for float registers the slot of THREAD_DATA::wide_values holding it
+};
+
+// A buffer handed from a target thread to the consumer
+class FULL_BUFFER{
 public:
-  std::list<regval> value_history; //value history. Most recently used is at index 0. maximum length is KnobHistDepth
-  ADDRINT tag; //What's the address? 
-  //UINT8 prediction_history; // Used to determine whether we will use historic value (CT entry)
-  VPT_ENTRY() {}
+    THREAD_DATA* td;
+    BUFFER_RECORD* records;
+    UINT64 count;
+    FULL_BUFFER(THREAD_DATA* t, VOID* buf, UINT64 n) : td(t), records((BUFFER_RECORD*) buf), count(n) {}
+};
+
+#define BUFFERS_PER_THREAD 4        // a thread waits for the consumer once all of its buffers are full
+
+// Records of one -buffer_pages buffer
+UINT64 buffer_records(){
+    return KnobBufferPages.Value() * getpagesize() / sizeof(BUFFER_RECORD);
+}
+
+BUFFER_ID buffer_id = BUFFER_ID_INVALID; // valid with -buffer_pages
+REG wide_slot_reg;                  // passes the wide_values slot of a float value to the fill buffer
+REG store_value_reg;                // -mem_values: passes a store's value, or its wide_values slot, to the fill buffer
+PIN_LOCK buffers_lock;              // guards full_buffers and every THREAD_DATA::free_buffers
+std::deque<FULL_BUFFER> full_buffers; // waiting to be simulated, in the order they filled up
+PIN_SEMAPHORE buffers_ready;        // set when a buffer is added to full_buffers
+PIN_LOCK simulate_lock;             // held while simulating buffers, so they are simulated in order
+PIN_THREAD_UID consumer_uid;
+volatile bool consumer_running;     // cleared when Pin prepares to exit, target threads then simulate their own buffers
+
+// All the VPUs being simulated, one per configuration
+std::vector<VPU*> vpus;
+VPU_CONFIG knob_config;             // the configuration set by the knobs
+std::vector<string> vpu_specs;      // -config / -config_file, to build per thread VPUs
+
+// Value trace being recorded (-trace_out), closed unless capturing
+TRACE_WRITER trace;
+
+bool child_process;                 // this process was forked from the one Pin started with
+AGG_REGION* aggregate;              // -aggregate, NULL if not aggregating
+
+// name with this process's pid appended, for output that processes must not share
+string process_file(const string& name){
+    return name + "." + decstr(getpid());
+}
+
+// Value locality and prediction counts summed over all threads, for the whole run or a sampled window
+class SAMPLE_COUNTS{
+public:
+    UINT64 prev_per_category[CATEGORIES];
+    UINT64 hit_per_category[CATEGORIES];
+    std::vector<VPU_STATS> stats; // one per configuration
+
+    SAMPLE_COUNTS() : stats(vpus.size()) {
+        memset(prev_per_category, 0, sizeof(prev_per_category));
+        memset(hit_per_category, 0, sizeof(hit_per_category));
+    }
+
+    VOID add(const SAMPLE_COUNTS& other){
+        for(UINT32 i = 0; i < CATEGORIES; i++){
+            prev_per_category[i] += other.prev_per_category[i];
+            hit_per_category[i] += other.hit_per_category[i];
+        }
+        for(UINT32 v = 0; v < stats.size(); v++){ stats[v].add(other.stats[v]); }
+    }
+
+    VOID subtract(const SAMPLE_COUNTS& other){
+        for(UINT32 i = 0; i < CATEGORIES; i++){
+            prev_per_category[i] -= other.prev_per_category[i];
+            hit_per_category[i] -= other.hit_per_category[i];
+        }
+        for(UINT32 v = 0; v < stats.size(); v++){ stats[v].subtract(other.stats[v]); }
+    }
+
+    VOID print(std::ostream& out) const {
+        print_vpu_results(out, vpus, stats, prev_per_category, hit_per_category);
+    }
 };
 
-// Declare global Value Prediction Table
-std::map<ADDRINT, VPT_ENTRY*> vpt;
-std::list<VPT_ENTRY*> vpt_viccache;
+// Predictor snapshots (-snapshot_in / -snapshot_out, see snapshot.h). Only the VPUs in vpus are
+// saved and loaded: the shared ones, or with private VPUs those of the first thread.
+SNAPSHOT snapshot_in;               // mapped for the whole run, the loaded VPUs use its tables
+SAMPLE_COUNTS* resumed;             // -resume: the counts of the snapshot's runs, NULL otherwise
+UINT64 resumed_insts;               // and the instructions they executed
+bool snapshots;                     // -snapshot_every
+PIN_LOCK snapshot_lock;             // guards snapshot_end
+volatile UINT64 snapshot_end;       // instruction count at which the next snapshot is saved
+
+// Sum the counts of every thread. Threads that are still running may be a few instructions ahead.
+VOID take_counts(SAMPLE_COUNTS& counts){
+    PIN_GetLock(&threads_lock, PIN_ThreadId() + 1);
+    FOR_X_IN_Y(t, threads){
+        THREAD_DATA* td = *t;
+        for(UINT32 i = 0; i < CATEGORIES; i++){
+            counts.prev_per_category[i] += td->prev_per_category[i];
+            counts.hit_per_category[i] += td->hit_per_category[i];
+        }
+        for(UINT32 v = 0; v < counts.stats.size(); v++){ counts.stats[v].add(td->stats[v]); }
+    }
+    PIN_ReleaseLock(&threads_lock);
+    if(resumed){ counts.add(*resumed); }
+}
 
+// Save vpus, the counts of all threads and the value locality of every instruction to
+// -snapshot_out, insts being the instructions executed so far. Instructions that are in
+// -snapshot_in but did not run this time are carried over. Threads keep running meanwhile, so the
+// snapshot is fuzzy by the instructions they execute while it is written.
+VOID save_snapshot(UINT64 insts){
+    SAMPLE_COUNTS counts;
+    take_counts(counts);
+    SNAPSHOT_HEADER header;
+    memset(&header, 0, sizeof(header));
+    header.insts_executed = insts + resumed_insts;
+    memcpy(header.prev_per_category, counts.prev_per_category, sizeof(header.prev_per_category));
+    memcpy(header.hit_per_category, counts.hit_per_category, sizeof(header.hit_per_category));
+
+    //inst_data and the saved records are both sorted by address, merge them
+    std::vector<SNAPSHOT_INST> records;
+    const SNAPSHOT_INST* saved = snapshot_in.loaded() ? snapshot_in.insts : NULL;
+    const SNAPSHOT_INST* saved_end = snapshot_in.loaded() ? saved + snapshot_in.header->inst_count : NULL;
+    PIN_LockClient(); //keeps instrumentation from adding to inst_data
+    PIN_GetLock(&threads_lock, PIN_ThreadId() + 1);
+    FOR_X_IN_Y(i, inst_data){
+        INST_DATA* ins_data = i->second;
+        while(saved != saved_end && saved->ins_ptr < i->first){ records.push_back(*saved++); }
+        SNAPSHOT_INST record;
+        memset(&record, 0, sizeof(record));
+        if(saved != saved_end && saved->ins_ptr == i->first){
+            record.last_value = saved->last_value;
+            if(resumed){ record = *saved; }
+            saved++;
+        }
+        record.ins_ptr = i->first;
+        record.flag = ins_data->flag;
+        FOR_X_IN_Y(t, threads){
+            INST_LOCALITY* chunk = (*t)->locality[ins_data->id >> LOCALITY_CHUNK_BITS];
+            if(!chunk || !chunk[ins_data->id & (LOCALITY_CHUNK_SIZE - 1)].hit_count){ continue; }
+            const INST_LOCALITY& loc = chunk[ins_data->id & (LOCALITY_CHUNK_SIZE - 1)];
+            record.hit_count += loc.hit_count;
+            record.prev_seen += loc.prev_seen;
+            if(!IS_FLOAT(ins_data->datatype)){ record.last_value = loc.last_value_seen; }
+        }
+        records.push_back(record);
+    }
+    PIN_ReleaseLock(&threads_lock);
+    PIN_UnlockClient();
+    while(saved != saved_end){ records.push_back(*saved++); }
+
+    string path = child_process ? process_file(KnobSnapshotOut.Value()) : KnobSnapshotOut.Value();
+    string error = write_snapshot(path, vpus, counts.stats, header, records);
+    if(!error.empty()){ cerr << error << endl; }
+}
+
+// Save the snapshot due at instruction count now, unless another thread has already
+VOID take_snapshot(UINT64 now){
+    PIN_GetLock(&snapshot_lock, PIN_ThreadId() + 1);
+    if(now >= snapshot_end){
+        save_snapshot(now);
+        snapshot_end = now + KnobSnapshotEvery.Value();
+    }
+    PIN_ReleaseLock(&snapshot_lock);
+}
+
+// Sampled simulation (-sample_ff or -simpoints). Each window fast-forwards with only instruction
+// counting, then simulates sample_warmup instructions to train the VPUs, then measures
+// sample_measure instructions. Instrumentation is thrown away whenever the simulation switches
+// on or off, so fast-forwarded code runs without analysis calls.
+enum SAMPLE_PHASE { SAMPLE_FF, SAMPLE_WARMUP, SAMPLE_MEASURE };
+
+class SAMPLE_WINDOW{
+public:
+    UINT64 start;        // instruction count when measuring started
+    UINT64 insts;        // instructions measured
+    SAMPLE_COUNTS counts;
+};
+
+bool sampling;
+PIN_LOCK sample_lock;               // guards everything below
+SAMPLE_PHASE sample_phase = SAMPLE_FF;
+volatile UINT64 sample_end;         // instruction count at which sample_phase ends
+UINT64 measure_at;                  // instruction count at which the next window measures
+std::vector<UINT64> simpoints;      // -simpoints, sorted
+UINT32 next_simpoint;
+SAMPLE_COUNTS* window_counts;       // counts when the current window started measuring
+std::vector<SAMPLE_WINDOW> windows; // measured windows
+PIN_SEMAPHORE phase_switched;       // set when simulation starts or stops, for sample_switcher
+PIN_THREAD_UID sample_switcher_uid;
+volatile bool sample_switcher_running;
+
+// Interval statistics (-interval). Every -interval instructions the counts of all threads are
+// snapshotted and queued with their difference to the previous snapshot. A Pin internal thread
+// appends the queue to -interval_out as CSV, one row per interval and configuration, so the target
+// never waits for the file and a killed run keeps the intervals written so far.
+class INTERVAL{
+public:
+    UINT64 index;
+    UINT64 insts;         // instruction count at the end of the interval
+    UINT32 copies;        // VPUs per configuration, one per thread unless -predictor shared
+    SAMPLE_COUNTS total;  // counts since the start of the run
+    SAMPLE_COUNTS delta;  // counts of this interval
+};
+
+bool intervals;
+PIN_LOCK interval_lock;             // guards everything below up to interval_out_lock
+volatile UINT64 interval_end;       // instruction count at which the current interval ends
+UINT64 interval_start;
+UINT64 interval_index;
+SAMPLE_COUNTS* interval_counts;     // counts at interval_start
+std::deque<INTERVAL*> interval_queue;
+PIN_SEMAPHORE intervals_ready;      // set when an interval is queued
+PIN_LOCK interval_out_lock;         // held while writing interval_out
+std::ofstream interval_out;
+PIN_THREAD_UID interval_writer_uid;
+volatile bool interval_writer_running;
+
+// Queue the interval ending at instruction count now. Unless last is set, only when now has
+// reached interval_end, as another thread may have queued it already.
+VOID take_interval(UINT64 now, bool last){
+    PIN_GetLock(&interval_lock, PIN_ThreadId() + 1);
+    if((last && now > interval_start) || (!last && now >= interval_end)){
+        INTERVAL* interval = new INTERVAL();
+        interval->index = interval_index++;
+        interval->insts = now;
+        interval->copies = shared_predictor ? 1 : threads.size();
+        take_counts(interval->total);
+        interval->delta = interval->total;
+        interval->delta.subtract(*interval_counts);
+        *interval_counts = interval->total;
+        interval_start = now;
+        interval_end = now + KnobInterval.Value();
+
+        interval_queue.push_back(interval);
+        PIN_SemaphoreSet(&intervals_ready);
+    }
+    PIN_ReleaseLock(&interval_lock);
+}
+
+VOID write_interval_header(){
+    interval_out << "interval,instructions,config";
+    for(UINT32 i = 1; i < CATEGORIES; i++){
+        interval_out << "," << INST_CAT_s[i] << "_locality," << INST_CAT_s[i] << "_total," << INST_CAT_s[i] << "_success,"
+                     << INST_CAT_s[i] << "_fail," << INST_CAT_s[i] << "_missed";
+    }
+    interval_out << ",vpt_occupancy,ct_occupancy,vpt_evictions,vc_hit_rate" << endl;
+}
+
+// Write the queued intervals to interval_out
+VOID write_intervals(){
+    PIN_GetLock(&interval_out_lock, PIN_ThreadId() + 1);
+    while(true){
+        PIN_GetLock(&interval_lock, PIN_ThreadId() + 1);
+        if(interval_queue.empty()){
+            PIN_SemaphoreClear(&intervals_ready);
+            PIN_ReleaseLock(&interval_lock);
+            break;
+        }
+        INTERVAL* interval = interval_queue.front();
+        interval_queue.pop_front();
+        PIN_ReleaseLock(&interval_lock);
+
+        for(UINT32 v = 0; v < vpus.size(); v++){
+            const SAMPLE_COUNTS& delta = interval->delta;
+            const VPU_STATS& stats = delta.stats[v];
+            const VPU_STATS& total = interval->total.stats[v];
+            interval_out << interval->index << "," << interval->insts << "," << v;
+            for(UINT32 i = 1; i < CATEGORIES; i++){
+                interval_out << "," << delta.prev_per_category[i] << "," << delta.hit_per_category[i] << "," << stats.pred_success[i]
+                             << "," << stats.pred_failed[i] << "," << stats.missed_success[i];
+            }
+            //occupancy is over the run so far, evictions and victim cache hits over the interval
+            double vpt_slots = (double) vpus[v]->VPT_ENTRIES * interval->copies;
+            double ct_slots = (double) vpus[v]->CT_ENTRIES * interval->copies;
+            interval_out << "," << (vpt_slots ? total.vpt_fills / vpt_slots : 0)
+                         << "," << (ct_slots ? total.ct_fills / ct_slots : 0)
+                         << "," << stats.vpt_evictions
+                         << "," << (stats.vpt_misses ? (double) stats.vc_hits / stats.vpt_misses : 0) << "\n";
+        }
+        delete interval;
+    }
+    interval_out.flush();
+    PIN_ReleaseLock(&interval_out_lock);
+}
 
-// Declare global Classification Table
-std::map<ADDRINT, UINT8> ct;
+VOID interval_writer(VOID* arg){
+    while(interval_writer_running){
+        PIN_SemaphoreTimedWait(&intervals_ready, 100);
+        write_intervals();
+    }
+}
 
 VOID populate_regs(){
     for(int rn = REG_INVALID_; rn != REG_LAST; rn++){
@@ -299,6 +715,23 @@ VOID populate_regs(){
 
 }
 
+// Parse -inst_cat, ALL or a comma separated list of INST_CAT names. Returns false on an unknown name.
+bool parse_inst_cat(const string& spec){
+    std::istringstream ss(spec);
+    string name;
+    while(std::getline(ss, name, ',')){
+        UINT32 i = 1;
+        if(name == "ALL"){
+            for(; i < CATEGORIES; i++){ inst_cat_enabled[i] = true; }
+            continue;
+        }
+        while(i < CATEGORIES && INST_CAT_s[i] != name){ i++; }
+        if(i == CATEGORIES){ return false; }
+        inst_cat_enabled[i] = true;
+    }
+    return true;
+}
+
 /* ===================================================================== */
 static INT32 Usage()
 {
@@ -310,11 +743,153 @@ static INT32 Usage()
     return -1;
 }
 
+// Schedule the next sampled window, measuring no earlier than instruction count from. Returns false
+// when all the -simpoints windows are done.
+bool next_window(UINT64 from){
+    if(simpoints.empty()){
+        measure_at = from + KnobSampleFF.Value() + KnobSampleWarmup.Value();
+    } else {
+        if(next_simpoint == simpoints.size()){ return false; }
+        measure_at = simpoints[next_simpoint++];
+        if(measure_at < from){ measure_at = from; }
+    }
+    sample_phase = SAMPLE_FF;
+    sample_end = measure_at - from > KnobSampleWarmup.Value() ? measure_at - KnobSampleWarmup.Value() : from;
+    return true;
+}
+
+// Start and finish measuring a window at instruction count now, with sample_lock held
+VOID begin_window(UINT64 now){
+    window_counts = new SAMPLE_COUNTS();
+    take_counts(*window_counts);
+    SAMPLE_WINDOW window;
+    window.start = now;
+    window.insts = 0;
+    windows.push_back(window);
+}
+
+VOID end_window(UINT64 now){
+    SAMPLE_WINDOW& window = windows.back();
+    take_counts(window.counts);
+    window.counts.subtract(*window_counts);
+    window.insts = now - window.start;
+    delete window_counts;
+}
+
+#ifdef PROFILE
+struct timespec tool_start; // when main() started
+
+// Write the TOOL PROFILE block: run time, analysis rate and the cycles spent per phase, summed
+// over all threads and configurations
+VOID print_profile(std::ostream& out){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - tool_start.tv_sec) + (now.tv_nsec - tool_start.tv_nsec) / 1e9;
+
+    UINT64 calls = 0;
+    UINT64 cycles[PROF_PHASES] = {0};
+    PIN_GetLock(&threads_lock, PIN_ThreadId() + 1);
+    FOR_X_IN_Y(t, threads){
+        THREAD_DATA* td = *t;
+        for(UINT32 i = 0; i < CATEGORIES; i++){ calls += td->hit_per_category[i]; }
+        for(UINT32 p = 0; p < PROF_PHASES; p++){ cycles[p] += td->cycles[p]; }
+        FOR_X_IN_Y(vs, td->stats){
+            for(UINT32 p = 0; p < PROF_PHASES; p++){ cycles[p] += vs->cycles[p]; }
+        }
+    }
+    PIN_ReleaseLock(&threads_lock);
+    UINT64 total = 0;
+    for(UINT32 p = 0; p < PROF_PHASES; p++){ total += cycles[p]; }
+
+    out << endl << "============== TOOL PROFILE ==============" << endl;
+    out << "Wall seconds|" << seconds << endl;
+    if(KnobNativeMs.Value()){ out << "Slowdown|" << seconds * 1000 / KnobNativeMs.Value() << endl; }
+    out << "Analysis calls|" << calls << endl;
+    out << "Analysis MIPS|" << (seconds ? calls / seconds / 1e6 : 0) << endl;
+    out << "PHASE" << "|" << "CYCLES" << "|" << "CYCLES_PER_CALL" << "|" << "SHARE" << endl;
+    for(UINT32 p = 0; p < PROF_PHASES; p++){
+        out << PROFILE_PHASE_s[p] << "|" << cycles[p] << "|" << (calls ? (double) cycles[p] / calls : 0)
+            << "|" << (total ? (double) cycles[p] / total : 0) << endl;
+    }
+}
+#endif
+
+/* ===================================================================== */
+/* Hot instructions                                                      */
+/* ===================================================================== */
+// Disassembly of the instruction at ins_ptr, found through its routine. Only done for the
+// instructions a report prints, so the run keeps no disassembly of the rest.
+string disassemble(ADDRINT ins_ptr){
+    string text = "?";
+    PIN_LockClient();
+    RTN rtn = RTN_FindByAddress(ins_ptr);
+    if(RTN_Valid(rtn)){
+        RTN_Open(rtn);
+        for(INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)){
+            if(INS_Address(ins) == ins_ptr){
+                text = INS_Disassemble(ins);
+                break;
+            }
+        }
+        RTN_Close(rtn);
+    }
+    PIN_UnlockClient();
+    return text;
+}
+
+// The -hot_pcs instructions that most often write their most frequent value, from the profiles
+// of all threads. VALUES lists value:executions pairs, most frequent first, with the values of float
+// registers shown as fingerprint(...); every count may be over by the ERROR it inherited from the
+// instruction or value that held its counter before.
+VOID print_hot(std::ostream& out){
+    std::vector<const HOT_PROFILE*> profiles;
+    UINT64 bytes = 0;
+    PIN_GetLock(&threads_lock, PIN_ThreadId() + 1);
+    FOR_X_IN_Y(t, threads){
+        if(!(*t)->hot){ continue; }
+        profiles.push_back((*t)->hot);
+        bytes += (*t)->hot->memory_bytes();
+    }
+    std::vector<HOT_PC> hot = hot_merge(profiles);
+    PIN_ReleaseLock(&threads_lock);
+
+    out << endl << "============== HOT INSTRUCTIONS ==============" << endl;
+    out << "Profile bytes| " << bytes << endl;
+    out << "RANK|PC|CATEGORY|EXECUTIONS|ERROR|TOP_VALUE_SHARE|VALUES|DISASSEMBLY" << endl;
+    for(UINT32 i = 0; i < hot.size() && i < KnobHotPcs.Value(); i++){
+        const HOT_PC& pc = hot[i];
+        string category = X_IN_Y(pc.ins_ptr, inst_data) ? INST_CAT_s[inst_data[pc.ins_ptr]->flag] : "?";
+        bool fingerprints = X_IN_Y(pc.ins_ptr, inst_data) && IS_FLOAT(inst_data[pc.ins_ptr]->datatype);
+        out << i + 1 << "|" << hexstr(pc.ins_ptr) << "|" << category << "|" << pc.count << "|" << pc.error << "|"
+            << (double) pc.invariant() / pc.count << "|";
+        for(UINT32 v = 0; v < pc.top_values.size(); v++){
+            out << (v ? "," : "");
+            if(fingerprints){ out << "fingerprint(" << hexstr(pc.top_values[v].key) << ")"; }
+            else { out << hexstr(pc.top_values[v].key); }
+            out << ":" << pc.top_values[v].count;
+        }
+        out << "|" << disassemble(pc.ins_ptr) << endl;
+    }
+}
+
 /* ===================================================================== */
 VOID PrintResults(bool limit_reached)
 {
+    PIN_GetLock(&print_lock, PIN_ThreadId() + 1);
+    //the trace ends with the dataflow registers of every instruction, for the replay's timing model
+    std::vector<std::pair<ADDRINT, INST_DATA*> > traced;
+    PIN_LockClient();
+    traced.assign(inst_data.begin(), inst_data.end());
+    PIN_UnlockClient();
+    PIN_GetLock(&trace_lock, PIN_ThreadId() + 1);
+    if(!trace.closed){
+        FOR_X_IN_Y(i, traced){ trace.add_inst(i->first, i->second->df_srcs, i->second->df_num_srcs, i->second->df_dst); }
+    }
+    trace.close(limit_reached);
+    PIN_ReleaseLock(&trace_lock);
+
     string output_file = KnobOutputFile.Value();
-    if(KnobPid.Value()) output_file += "." + getpid();
+    if(KnobPid.Value() || child_process){ output_file = process_file(output_file); }
 
     std::ofstream out(output_file.c_str(), std::ios_base::app);
     //if (!output_file.empty()) { out = new std::ofstream(output_file.c_str());}
@@ -341,199 +916,550 @@ VOID PrintResults(bool limit_reached)
     }
 #endif
 
-    //Aggregates the value locality statistics from all instructions that have flag set. 
-    UINT32 total_prev = 0;
-    UINT32 total_hit_count = 0;
-    UINT32 total_success = 0;
-    UINT32 total_fail = 0;
-    UINT32 total_missed_success = 0;
-    UINT32 prev_per_category[CATEGORIES] = {0};
-    UINT32 hit_per_category[CATEGORIES] = {0};
-    UINT32 success_per_category[CATEGORIES] = {0};
-    UINT32 fail_per_category[CATEGORIES] = {0};
-    UINT32 missed_success_per_category[CATEGORIES] = {0};
-    //out << "Degree of Value Locality: " << endl;
-    FOR_X_IN_Y(i, inst_data){
-        if(i->second->flag){
-            total_prev += i->second->prev_seen;
-            total_hit_count  +=  i->second->hit_count;
-            total_success += i->second->pred_success;
-            total_fail += i->second->pred_failed;
-            total_missed_success += i->second->missed_success;
-            //out << i->second->disassembly << ": " << i->second->prev_seen << "/" << i->second->hit_count << endl;
-            prev_per_category[i->second->flag] += i->second->prev_seen;
-            hit_per_category[i->second->flag] += i->second->hit_count;
-            success_per_category[i->second->flag] += i->second->pred_success;
-            fail_per_category[i->second->flag] += i->second->pred_failed;
-            missed_success_per_category[i->second->flag] += i->second->missed_success;
-        }
-    }
-
-    out << "Instruction total| " << insts_executed << endl;
+    //Merges the statistics of all threads. Threads still running at the instruction limit
+    // may be a few instructions ahead of what gets printed.
+    UINT64 insts_executed = 0;
+    PIN_GetLock(&threads_lock, PIN_ThreadId() + 1);
+    FOR_X_IN_Y(t, threads){
+        insts_executed += (*t)->insts_executed + (*t)->insts_batch;
+    }
+    PIN_ReleaseLock(&threads_lock);
+
+    if(intervals){
+        //the interval in progress, then everything still queued
+        take_interval(insts_executed, true);
+        write_intervals();
+    }
+
+    out << "Instruction total| " << insts_executed + resumed_insts << endl;
+    if(resumed){ out << "Resumed instructions| " << resumed_insts << endl; }
     if(limit_reached)
         out << "Reason| limit reached\n";
     else
         out << "Reason| fini\n";
+    if(dataflow_timing){
+        out << "Issue width| " << issue_width << endl;
+        out << "VP penalty| " << vp_penalty << endl;
+    }
 
-    out << endl << "============== LOCALITY DATA =============" << endl;
-    out << "OPERATION" << "|" << "LOCALITY_COUNT" << "|" << "TOTAL_COUNT" << "|" << "SUCCESS_COUNT" << "|" << "FAIL_COUNT" << "|" << "MISSED_SUCCESS" << endl;
-    out << "Total|" << total_prev << "|" << total_hit_count << "|" << total_success << "|" << total_fail << "|" << total_missed_success << endl;
-    for(short i = 0; i < CATEGORIES; i++) {
-      out << INST_CAT_s[i] << "|" << prev_per_category[i] << "|" << hit_per_category[i] << "|" << success_per_category[i] << "|" << fail_per_category[i] << "|" << missed_success_per_category[i] <<endl;
+    if(!sampling){
+        SAMPLE_COUNTS counts;
+        take_counts(counts);
+        counts.print(out);
+        if(aggregate){
+            if(resumed){ counts.subtract(*resumed); } //the resumed run added its own
+            agg_add(aggregate, insts_executed, counts.prev_per_category, counts.hit_per_category, counts.stats);
+        }
+    } else {
+        PIN_GetLock(&sample_lock, PIN_ThreadId() + 1);
+        if(sample_phase == SAMPLE_MEASURE){ end_window(insts_executed); } //the run ended inside a window
+        sample_phase = SAMPLE_FF;
+
+        //Each window on its own, then all of them added up
+        SAMPLE_COUNTS total;
+        UINT64 total_insts = 0;
+        for(UINT32 w = 0; w < windows.size(); w++){
+            out << endl << "============== WINDOW " << w << " ==============" << endl;
+            out << "Window start| " << windows[w].start << endl;
+            out << "Window instructions| " << windows[w].insts << endl;
+            windows[w].counts.print(out);
+            total.add(windows[w].counts);
+            total_insts += windows[w].insts;
+        }
+        out << endl << "============== SAMPLED TOTAL ==============" << endl;
+        out << "Windows| " << windows.size() << endl;
+        out << "Window instructions| " << total_insts << endl;
+        total.print(out);
+        if(aggregate){ agg_add(aggregate, total_insts, total.prev_per_category, total.hit_per_category, total.stats); }
+        PIN_ReleaseLock(&sample_lock);
     }
 
-    out << endl << "============== VPT SETTINGS ==============" << endl;
-    out << "VPT_BITS" << "|" << (UINT32)VPT_BITS << endl;
-    out << "VPT_ENTRIES" << "|" << (UINT32)VPT_ENTRIES << endl;
-    out << "VH_DEPTH" << "|" << (UINT32)KnobHistDepth.Value() << endl;
-    out << "CT_ENTRIES" << "|" << (UINT32)CT_ENTRIES << endl;
-    out << "CT_PERF" << "|" << (bool)CT_PERF << endl;
-    out << "CT_PRED_TH" << "|" << (UINT32)CT_PRED_TH << endl;
-    out << "CT_REP_TH" << "|" << (UINT32)CT_REP_TH << endl;
+    if(KnobHotPcs.Value()){ print_hot(out); }
+
+#ifdef PROFILE
+    print_profile(out);
+#endif
+
+    if(!KnobSnapshotOut.Value().empty()){ save_snapshot(insts_executed); }
 
-    out << endl << endl;
     //out << endl << "=============== VPT DATA ================" << endl;
     //FOR_X_IN_Y(i, vpt) {
     //  cout << OPCODE_StringShort(i->first) << "|" << (UINT32)i->second->prediction_history << endl;
     //}
+    out.close();
+    PIN_ReleaseLock(&print_lock);
+}
+
+
+// Count the instrumented instructions of a basic block as it starts, inlined by Pin.
+// Returns nonzero when the batch has to be flushed.
+ADDRINT PIN_FAST_ANALYSIS_CALL count_block(THREAD_DATA* td, UINT32 insts){
+    td->insts_batch += insts;
+    return td->insts_batch >= td->batch_limit;
+}
+
+// Set the size of td's next batch so that flushing it catches the instruction limit, the end
+// of the current sampling phase and the end of the current interval
+inline VOID next_batch(THREAD_DATA* td, UINT64 flushed){
+    UINT64 left = KnobLimit.Value() - flushed;
+    UINT64 batch = left < INSTS_BATCH ? left + 1 : INSTS_BATCH;
+    UINT64 end = sample_end;
+    if(sampling && end > flushed && end - flushed < batch){ batch = end - flushed; }
+    end = interval_end;
+    if(intervals && end > flushed && end - flushed < batch){ batch = end - flushed; }
+    end = snapshot_end;
+    if(snapshots && end > flushed && end - flushed < batch){ batch = end - flushed; }
+    td->batch_limit = batch;
 }
 
+VOID drain_buffers(); // Buffered simulation, below
 
-VOID value_predict(ADDRINT ins_ptr, INST_DATA* ins_data , PIN_REGISTER* ref){
-   if(insts_executed > KnobLimit.Value()){
-        cout << "Ending " << endl;
-        PrintResults(true);
-        PIN_ExitProcess(EXIT_SUCCESS);
+// Called once the instruction limit is passed: write the results and let the program go on natively
+VOID limit_reached(){
+    if(!__sync_bool_compare_and_swap(&limit_hit, false, true)){ return; } //another thread got here first
+    cout << "Ending " << endl;
+    if(buffer_id != BUFFER_ID_INVALID){ drain_buffers(); }
+    PrintResults(true);
+    PIN_Detach();
+}
+
+// Move on from phases that end at or before instruction count flushed
+VOID advance_sample(UINT64 flushed){
+    bool finished = false;
+    PIN_GetLock(&sample_lock, PIN_ThreadId() + 1);
+    bool simulating = sample_phase != SAMPLE_FF;
+    while(flushed >= sample_end && !finished){
+        if(sample_phase == SAMPLE_FF){
+            sample_phase = SAMPLE_WARMUP;
+            sample_end = measure_at;
+        } else if(sample_phase == SAMPLE_WARMUP){
+            sample_phase = SAMPLE_MEASURE;
+            sample_end = measure_at + KnobSampleMeasure.Value();
+            begin_window(flushed);
+        } else {
+            end_window(flushed);
+            finished = !next_window(sample_end);
+        }
+    }
+    if(finished){
+        sample_phase = SAMPLE_FF;
+        sample_end = ~(UINT64) 0;
     }
-    insts_executed++;    
-    ins_data->hit_count++;
+    bool switched = simulating != (sample_phase != SAMPLE_FF);
+    PIN_ReleaseLock(&sample_lock);
 
-    // ref is pointer to area of memory
-    regval value_to_write = regval(ref, ins_data->datatype);
+    if(finished){
+        limit_reached(); //nothing left to measure
+    } else if(switched){
+        PIN_SemaphoreSet(&phase_switched); //analysis routines cannot remove instrumentation themselves
+    }
+}
+
+// Pin internal thread: removes the instrumentation when sampling starts or stops simulating, so
+// Trace() instruments for the new phase from then on. Until it gets to it the code already
+// instrumented keeps running as it is, which only delays the switch slightly.
+VOID sample_switcher(VOID* arg){
+    while(sample_switcher_running){
+        if(!PIN_SemaphoreTimedWait(&phase_switched, 100)){ continue; }
+        PIN_SemaphoreClear(&phase_switched);
+        PIN_RemoveInstrumentation();
+    }
+}
+
+// Add td's batch to insts_flushed, called when count_block says so
+VOID PIN_FAST_ANALYSIS_CALL flush_batch(THREAD_DATA* td){
+    UINT64 flushed = __sync_add_and_fetch(&insts_flushed, td->insts_batch);
+    td->insts_executed += td->insts_batch;
+    td->insts_batch = 0;
+    if(flushed > KnobLimit.Value()){
+        td->batch_limit = INSTS_BATCH;
+        limit_reached();
+        return;
+    }
+    if(sampling && flushed >= sample_end){ advance_sample(flushed); }
+    if(intervals && flushed >= interval_end){ take_interval(flushed, false); }
+    if(snapshots && flushed >= snapshot_end){ take_snapshot(flushed); }
+    next_batch(td, flushed);
+}
+
+// Run one value through vpu with kernel K, which every VPU runs, inlined into record_value.
+// KERNEL_MIXED: the VPUs run different kernels, each through its VPU::kernel pointer.
+#define KERNEL_MIXED (KERNEL_GENERIC + 1)
+template<UINT32 K>
+inline PREDICTION run_kernel(VPU* vpu, ADDRINT ins_ptr, const regval& value_to_write, RT datatype, INST_CAT flag, VPU_STATS& stats){
+    return VP_KERNEL<K>::predict(vpu, ins_ptr, value_to_write, datatype, flag, stats);
+}
+template<>
+inline PREDICTION run_kernel<KERNEL_MIXED>(VPU* vpu, ADDRINT ins_ptr, const regval& value_to_write, RT datatype, INST_CAT flag, VPU_STATS& stats){
+    return vpu->predict(ins_ptr, value_to_write, datatype, flag, stats);
+}
+
+UINT32 vpus_kernel;                 // the VP_KERNEL_ID of every VPU, or KERNEL_MIXED
+
+// Simulate one value written by a thread: value locality, the trace and every VPU of the thread
+// that predicts its stream. Specialized on the register type, for floats on the register width in
+// bytes, and on the predictor kernel K of the VPUs.
+template<RT TYPE, UINT32 BYTES, UINT32 K>
+VOID record_value(THREAD_DATA* td, ADDRINT ins_ptr, INST_DATA* ins_data, const regval& value_to_write){
+    PROFILE_START(t);
+    INST_LOCALITY& loc = td->get_locality(ins_data, BYTES);
+    loc.hit_count++;
+    td->hit_per_category[ins_data->flag]++;
 
 #ifdef PRINTF
     cout << ins_data->disassembly << endl;
 
-    cout << "IP " << (ins_ptr & 0xFFFF) << " wrote val (" <<  rt_name[ins_data->datatype]  <<"): " << value_to_write <<","  << ins_data->last_value_seen << " to " <<REG_StringShort(ins_data->write_reg)  <<endl; 
+    cout << "IP " << (ins_ptr & 0xFFFF) << " wrote val (" <<  rt_name[TYPE]  <<"): " << value_to_write <<","  << (IS_FLOAT(TYPE) ? 0 : loc.last_value_seen) << " to " <<REG_StringShort(ins_data->write_reg)  <<endl; 
 #endif
 
     // Update list of all instructions
-    if(value_to_write == ins_data->last_value_seen){
-        ins_data->prev_seen++; 
+    if(value_to_write.same<TYPE, BYTES>(loc.last_value_seen, loc.last_wide_seen)){
+        loc.prev_seen++; 
+        td->prev_per_category[ins_data->flag]++;
     } 
-    ins_data->last_value_seen = value_to_write; 
+    if(IS_FLOAT(TYPE)){
+        memcpy(loc.last_wide_seen, value_to_write.float_store, BYTES); 
+    } else {
+        loc.last_value_seen = value_to_write.value;
+    }
+    UINT32 stream = stream_of(ins_data->flag);
+    bool mem = stream != STREAM_REG;
+    if(td->hot && !mem){
+        //floats by a fingerprint of their full width, so vectors that only differ in the upper lanes stay apart
+        UINT32 check;
+        td->hot->count(ins_ptr, IS_FLOAT(TYPE) ? value_fingerprint(value_to_write, value_to_write.bytes, check)
+                                               : value_to_write.value & INT_MASK[TYPE]);
+    }
+    PROFILE_LAP(t, td->cycles, PROF_LOCALITY);
 
-    UINT32 vpt_index = ins_ptr & VPT_MASK;  // Calculate index in VPT
-    UINT32 ct_index = ins_ptr & CT_MASK;    // Calculate index in VPT
+    if(!trace.closed){
+        PIN_GetLock(&trace_lock, PIN_ThreadId() + 1);
+        trace.append(ins_ptr, ins_data->flag, TYPE, value_to_write, ins_data->first);
+        PIN_ReleaseLock(&trace_lock);
+        PROFILE_LAP(t, td->cycles, PROF_TRACE);
+    }
 
+    //the dataflow model only follows registers
+    bool timed = dataflow_timing && !mem;
+    UINT64 base_added = 0;
+    if(timed){
+        base_added = td->base_timing->step(ins_data->df_srcs, ins_data->df_num_srcs, ins_data->df_dst, PRED_NONE, issue_width, vp_penalty);
+        PROFILE_LAP(t, td->cycles, PROF_TIMING);
+    }
 
-    //If there's a collision in the VPT, then evict it!
-    if(X_IN_Y(vpt_index, vpt) && ins_ptr != vpt[vpt_index]->tag ){
-        //if the victim cache is full, evict the lru 
-        if(vpt_viccache.size() >= KnobVictimCache.Value()){
-            VPT_ENTRY* to_delete = vpt_viccache.back();
-            delete to_delete;
-            vpt_viccache.pop_back();
+    for(UINT32 v = 0; v < td->vpus.size(); v++){
+        if(mem_streams && td->vpus[v]->STREAM != stream){ continue; }
+        PREDICTION prediction = run_kernel<K>(td->vpus[v], ins_ptr, value_to_write, TYPE, ins_data->flag, td->stats[v]);
+        if(timed){
+            PROFILE_START(tv);
+            td->stats[v].base_cycles += base_added;
+            td->stats[v].vp_cycles += td->timing[v]->step(ins_data->df_srcs, ins_data->df_num_srcs, ins_data->df_dst, prediction, issue_width, vp_penalty);
+            PROFILE_LAP(tv, td->cycles, PROF_TIMING);
         }
+    }
+}
+
+// Analysis routine for instructions writing a general purpose register, which Pin passes by value
+template<RT TYPE, UINT32 K>
+VOID PIN_FAST_ANALYSIS_CALL value_predict_gr(THREAD_DATA* td, ADDRINT ins_ptr, INST_DATA* ins_data, ADDRINT value){
+    PROFILE_START(t);
+    regval value_to_write((UINT64) value, TYPE);
+    PROFILE_LAP(t, td->cycles, PROF_CAPTURE);
+    record_value<TYPE, 8, K>(td, ins_ptr, ins_data, value_to_write);
+}
 
-        //insert it into the front of Victim cache 
-        vpt_viccache.push_front(vpt[vpt_index]);
-        vpt.erase(vpt_index);
+// Analysis routine for instructions writing a float register of BYTES bytes
+template<UINT32 BYTES, UINT32 K>
+VOID PIN_FAST_ANALYSIS_CALL value_predict_fr(THREAD_DATA* td, ADDRINT ins_ptr, INST_DATA* ins_data , PIN_REGISTER* ref){
+    // ref is pointer to area of memory
+    PROFILE_START(t);
+    regval value_to_write;
+    value_to_write.set_float(ref, BYTES);
+    PROFILE_LAP(t, td->cycles, PROF_CAPTURE);
+    record_value<freg, BYTES, K>(td, ins_ptr, ins_data, value_to_write);
+}
+
+// Analysis routine after a store of BYTES bytes (-mem_values), which reads back the value written
+// to the address save_store_ea kept
+template<RT TYPE, UINT32 BYTES, UINT32 K>
+VOID PIN_FAST_ANALYSIS_CALL store_predict(THREAD_DATA* td, ADDRINT ins_ptr, INST_DATA* ins_data){
+    PROFILE_START(t);
+    regval value_to_write;
+    if(IS_FLOAT(TYPE)){
+        UINT8 bytes[BYTES];
+        PIN_SafeCopy(bytes, (VOID*) td->store_ea, BYTES);
+        value_to_write.set_float(bytes, BYTES);
+    } else {
+        UINT64 value = 0;
+        PIN_SafeCopy(&value, (VOID*) td->store_ea, BYTES);
+        value_to_write = regval(value, TYPE);
     }
+    PROFILE_LAP(t, td->cycles, PROF_CAPTURE);
+    record_value<TYPE, (IS_FLOAT(TYPE) ? BYTES : 8), K>(td, ins_ptr, ins_data, value_to_write);
+}
 
-    //first scan the victim cache if we get a hit 
-    bool vic_cache_hit = false; 
-    FOR_X_IN_Y(vc_entry, vpt_viccache){
+// Before a store: keep the address it writes, which Pin only passes before the instruction
+VOID PIN_FAST_ANALYSIS_CALL save_store_ea(THREAD_DATA* td, ADDRINT ea){
+    td->store_ea = ea;
+}
 
-        //We get a hit!
-        if( (*vc_entry)->tag == ins_ptr){
-            //cout << "Victim cache hit " << ins_ptr  << " Victim cache size " << vpt_viccache.size() <<endl;
+// Whether stores of bytes bytes are simulated: the integer sizes and the vector register widths
+bool store_size_supported(UINT32 bytes){
+    return bytes == 1 || bytes == 2 || bytes == 4 || bytes == 8 || bytes == 16 || bytes == 32 || bytes == 64;
+}
 
-            //take victim cache and insert it into VPT 
-            vpt[vpt_index] = (*vc_entry) ; //vpt[vpt_index] is null before this because the above code would have eviccted it.
-            //take it out of the victim cache 
-            vpt_viccache.remove( *vc_entry);
-            vic_cache_hit = true; 
+// Pick the analysis routine and record_value instance for the store value ins_data stands for
+template<UINT32 K>
+VOID select_store_routines(INST_DATA* ins_data){
+    switch(ins_data->datatype){
+        case i8reg:
+            ins_data->analysis = (AFUNPTR) store_predict<i8reg, 1, K>;
+            ins_data->record = record_value<i8reg, 8, K>;
+            break;
+        case i16reg:
+            ins_data->analysis = (AFUNPTR) store_predict<i16reg, 2, K>;
+            ins_data->record = record_value<i16reg, 8, K>;
+            break;
+        case i32reg:
+            ins_data->analysis = (AFUNPTR) store_predict<i32reg, 4, K>;
+            ins_data->record = record_value<i32reg, 8, K>;
+            break;
+        case i64reg:
+            ins_data->analysis = (AFUNPTR) store_predict<i64reg, 8, K>;
+            ins_data->record = record_value<i64reg, 8, K>;
+            break;
+        case freg:
+            if(ins_data->value_bytes == 16){
+                ins_data->analysis = (AFUNPTR) store_predict<freg, 16, K>;
+                ins_data->record = record_value<freg, 16, K>;
+            } else if(ins_data->value_bytes == 32){
+                ins_data->analysis = (AFUNPTR) store_predict<freg, 32, K>;
+                ins_data->record = record_value<freg, 32, K>;
+            } else {
+                ins_data->analysis = (AFUNPTR) store_predict<freg, MAX_BYTES_PER_PIN_REG, K>;
+                ins_data->record = record_value<freg, MAX_BYTES_PER_PIN_REG, K>;
+            }
             break;
-        }
     }
+}
 
-    // Create VPT entry if it doesn't exist
-    if(!vic_cache_hit &&  !X_IN_Y(vpt_index, vpt)){
-      #ifdef PRINTF
-      cout << "IP: " << ins_ptr << " --> " << (vpt_index) << endl;
-      #endif
-      vpt[vpt_index] = new VPT_ENTRY();          // Initialize class entry
-      vpt[vpt_index]->tag = ins_ptr;
-      vpt[vpt_index]->value_history.push_front(value_to_write);  // put write value as first VPT 
-    }
-
-    if(!X_IN_Y(ct_index, ct)){
-      ct[ct_index] = 0;
-    }
-    else {
-      #ifdef PRINTF
-      cout << "IP: " << ins_ptr << " [" << (ct_index) << "]" << endl;
-      // need to calculate if above threshold
-      cout << "Old val(s): "; 
-      FOR_X_IN_Y(vh_val, vpt[vpt_index]->value_history){
-        cout << *vh_val << ", ";
-      }
-      cout << endl;
-      cout << "New val: " << value_to_write << endl;
-      #endif
-
-      if(X_IN_LIST_Y(value_to_write, vpt[vpt_index]->value_history) ) {
-        #ifdef PRINTF
-        cout << "SUCCESS" << endl;
-        #endif
-        // If it's passed the threshold make prediction
-        if(CT_PERF || (ct[ct_index] >= CT_PRED_TH)) {
-          ins_data->pred_success++;
-        }
-        else {
-          ins_data->missed_success++;
-        }
-        // Increment prediction history
-        if(ct[ct_index] < CT_MAX) { ct[ct_index]++; }
-      }
-      else {
-        #ifdef PRINTF
-        cout << "FAIL" << endl;
-        #endif
-        // If it's passed the threshold make (wrong) prediction
-        if(!CT_PERF && (ct[ct_index] >= CT_PRED_TH)) {
-          ins_data->pred_failed++;
-        }
-        // Decrement prediction history
-        if(ct[ct_index] > 0) { ct[ct_index]--; }
-      }
-      // Update actual VPT unless we are over the replacement threshold
-      if(!(ct[ct_index] >= CT_REP_TH)) {
-
-        //if we found an value we used before, just move it to the front (to keep track of LRU) 
-        if(X_IN_LIST_Y(value_to_write, vpt[vpt_index]->value_history) ){
-            vpt[vpt_index]->value_history.remove(value_to_write);
-            vpt[vpt_index]->value_history.push_front(value_to_write);
-        }else{
-            //add a new value to our value history (if space permits)
-            if(vpt[vpt_index]->value_history.size() >= KnobHistDepth.Value() ){
-                //Evict!!
-                vpt[vpt_index]->value_history.pop_back();
+// Pick the analysis routine and record_value instance for the register ins_data writes, for VPUs
+// running kernel K. A load address is passed like a 64 bit register.
+template<UINT32 K>
+VOID select_kernel_routines(INST_DATA* ins_data){
+    if(ins_data->flag == M_STORE_VALUE){
+        select_store_routines<K>(ins_data);
+        return;
+    }
+    switch(ins_data->datatype){
+        case i8reg:
+            ins_data->analysis = (AFUNPTR) value_predict_gr<i8reg, K>;
+            ins_data->record = record_value<i8reg, 8, K>;
+            break;
+        case i16reg:
+            ins_data->analysis = (AFUNPTR) value_predict_gr<i16reg, K>;
+            ins_data->record = record_value<i16reg, 8, K>;
+            break;
+        case i32reg:
+            ins_data->analysis = (AFUNPTR) value_predict_gr<i32reg, K>;
+            ins_data->record = record_value<i32reg, 8, K>;
+            break;
+        case i64reg:
+            ins_data->analysis = (AFUNPTR) value_predict_gr<i64reg, K>;
+            ins_data->record = record_value<i64reg, 8, K>;
+            break;
+        case freg:
+            //mmx, xmm and ymm are compared over their own width, anything else (x87, zmm) over the whole PIN_REGISTER
+            ins_data->value_bytes = REG_Size(ins_data->write_reg);
+            if(ins_data->value_bytes == 8){
+                ins_data->analysis = (AFUNPTR) value_predict_fr<8, K>;
+                ins_data->record = record_value<freg, 8, K>;
+            } else if(ins_data->value_bytes == 16){
+                ins_data->analysis = (AFUNPTR) value_predict_fr<16, K>;
+                ins_data->record = record_value<freg, 16, K>;
+            } else if(ins_data->value_bytes == 32){
+                ins_data->analysis = (AFUNPTR) value_predict_fr<32, K>;
+                ins_data->record = record_value<freg, 32, K>;
+            } else {
+                ins_data->value_bytes = MAX_BYTES_PER_PIN_REG;
+                ins_data->analysis = (AFUNPTR) value_predict_fr<MAX_BYTES_PER_PIN_REG, K>;
+                ins_data->record = record_value<freg, MAX_BYTES_PER_PIN_REG, K>;
             }
-            vpt[vpt_index]->value_history.push_front(value_to_write);
+            break;
+    }
+}
+
+// The dispatch table: the routines of the kernel the VPUs run, see VP_KERNEL_ID
+VOID select_routines(INST_DATA* ins_data){
+    switch(vpus_kernel){
+        case KERNEL_D1_CT1: select_kernel_routines<KERNEL_D1_CT1>(ins_data); break;
+        case KERNEL_D1_CT2: select_kernel_routines<KERNEL_D1_CT2>(ins_data); break;
+        case KERNEL_D1_CT1_VC: select_kernel_routines<KERNEL_D1_CT1_VC>(ins_data); break;
+        case KERNEL_D1_CT2_VC: select_kernel_routines<KERNEL_D1_CT2_VC>(ins_data); break;
+        case KERNEL_D1_PERFECT: select_kernel_routines<KERNEL_D1_PERFECT>(ins_data); break;
+        case KERNEL_D4_CT2: select_kernel_routines<KERNEL_D4_CT2>(ins_data); break;
+        case KERNEL_D4_CT2_VC: select_kernel_routines<KERNEL_D4_CT2_VC>(ins_data); break;
+        case KERNEL_GENERIC: select_kernel_routines<KERNEL_GENERIC>(ins_data); break;
+        default: select_kernel_routines<KERNEL_MIXED>(ins_data);
+    }
+}
+
+/* ===================================================================== */
+/* Buffered simulation (-buffer_pages)                                   */
+/* ===================================================================== */
+// Target threads only append (IP, INST_DATA*, value) records to a Pin trace buffer. Full buffers
+// are queued for a Pin internal thread, the consumer, which runs them through record_value in the
+// order they filled up, so the target keeps running while its values are simulated.
+
+// Copy a float register into the thread's ring and return its slot, which goes into the buffer.
+// A slot is reused only after BUFFERS_PER_THREAD + 1 buffers worth of values, by which time the
+// buffer referring to it has been simulated.
+ADDRINT PIN_FAST_ANALYSIS_CALL capture_wide(THREAD_DATA* td, PIN_REGISTER* ref){
+    ADDRINT slot = td->wide_next;
+    memcpy(td->wide_values + slot * MAX_BYTES_PER_PIN_REG, ref, MAX_BYTES_PER_PIN_REG);
+    td->wide_next = (slot + 1 == td->wide_slots) ? 0 : slot + 1;
+    return slot;
+}
+
+// Read back the value a store of BYTES bytes wrote, for the buffer: the value itself, or the slot
+// of the thread's ring it is copied to if it is wider than an ADDRINT
+template<UINT32 BYTES>
+ADDRINT PIN_FAST_ANALYSIS_CALL capture_store(THREAD_DATA* td){
+    if(BYTES <= 8){
+        UINT64 value = 0;
+        PIN_SafeCopy(&value, (VOID*) td->store_ea, BYTES);
+        return value;
+    }
+    ADDRINT slot = td->wide_next;
+    PIN_SafeCopy(td->wide_values + slot * MAX_BYTES_PER_PIN_REG, (VOID*) td->store_ea, BYTES);
+    td->wide_next = (slot + 1 == td->wide_slots) ? 0 : slot + 1;
+    return slot;
+}
+
+// capture_store instance for stores of bytes bytes
+AFUNPTR capture_store_of(UINT32 bytes){
+    switch(bytes){
+        case 1: return (AFUNPTR) capture_store<1>;
+        case 2: return (AFUNPTR) capture_store<2>;
+        case 4: return (AFUNPTR) capture_store<4>;
+        case 8: return (AFUNPTR) capture_store<8>;
+        case 16: return (AFUNPTR) capture_store<16>;
+        case 32: return (AFUNPTR) capture_store<32>;
+        default: return (AFUNPTR) capture_store<MAX_BYTES_PER_PIN_REG>;
+    }
+}
+
+// Simulate the records of one buffer
+VOID simulate_buffer(const FULL_BUFFER& full){
+    for(UINT64 i = 0; i < full.count; i++){
+        const BUFFER_RECORD& record = full.records[i];
+        INST_DATA* ins_data = record.ins_data;
+        regval value_to_write;
+        if(IS_FLOAT(ins_data->datatype)){
+            value_to_write.set_float(full.td->wide_values + record.value * MAX_BYTES_PER_PIN_REG, ins_data->value_bytes);
+        } else {
+            value_to_write = regval((UINT64) record.value, ins_data->datatype);
         }
-      }
-      #ifdef PRINTF
-      cout << "Updated Value History: "; 
-      FOR_X_IN_Y(vh_val, vpt[vpt_index]->value_history){
-        cout << *vh_val << ", ";
-      }
-      cout << endl;
-      #endif  
+        ins_data->record(full.td, record.ins_ptr, ins_data, value_to_write);
     }
 }
 
+// Simulate queued buffers until the queue is empty, handing each back to its thread
+VOID simulate_queued(){
+    PIN_GetLock(&simulate_lock, PIN_ThreadId() + 1);
+    while(true){
+        PIN_GetLock(&buffers_lock, PIN_ThreadId() + 1);
+        if(full_buffers.empty()){
+            PIN_SemaphoreClear(&buffers_ready);
+            PIN_ReleaseLock(&buffers_lock);
+            break;
+        }
+        FULL_BUFFER full = full_buffers.front();
+        full_buffers.pop_front();
+        PIN_ReleaseLock(&buffers_lock);
+
+        simulate_buffer(full);
+        memset(full.records, 0, full.count * sizeof(BUFFER_RECORD)); //so drain_buffers sees where its records end
+
+        PIN_GetLock(&buffers_lock, PIN_ThreadId() + 1);
+        full.td->free_buffers.push_back(full.records);
+        PIN_SemaphoreSet(&full.td->buffer_freed);
+        PIN_ReleaseLock(&buffers_lock);
+    }
+    PIN_ReleaseLock(&simulate_lock);
+}
+
+VOID consumer(VOID* arg){
+    while(consumer_running){
+        PIN_SemaphoreTimedWait(&buffers_ready, 10);
+        simulate_queued();
+    }
+}
+
+// Called by Pin in the target thread when its buffer is full, and when the thread exits
+VOID* buffer_full(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf, UINT64 count, VOID *v){
+    THREAD_DATA* td = (THREAD_DATA*) PIN_GetThreadData(thread_key, tid);
+    PIN_GetLock(&buffers_lock, tid + 1);
+    full_buffers.push_back(FULL_BUFFER(td, buf, count));
+    PIN_SemaphoreSet(&buffers_ready);
+    PIN_ReleaseLock(&buffers_lock);
+
+    //Fill the next free buffer, waiting for the consumer if there is none
+    while(true){
+        PIN_GetLock(&buffers_lock, tid + 1);
+        if(!td->free_buffers.empty()){
+            VOID* next = td->free_buffers.back();
+            td->free_buffers.pop_back();
+            td->filling = next;
+            PIN_ReleaseLock(&buffers_lock);
+            return next;
+        }
+        PIN_SemaphoreClear(&td->buffer_freed);
+        PIN_ReleaseLock(&buffers_lock);
+
+        if(consumer_running){
+            PIN_SemaphoreTimedWait(&td->buffer_freed, 10);
+        } else {
+            simulate_queued(); //the consumer has exited, so nobody else will
+        }
+    }
+}
+
+// At inst_limit: simulate the queued buffers, then the records already in the buffer each thread
+// is filling, which Pin would only hand over when the thread exits, so the results can be written
+// before detaching. Threads still running may add a few records meanwhile, which are left out.
+VOID drain_buffers(){
+    consumer_running = false; //target threads simulate their own buffers from now on
+    simulate_queued();
+    PIN_GetLock(&simulate_lock, PIN_ThreadId() + 1);
+    PIN_GetLock(&threads_lock, PIN_ThreadId() + 1);
+    UINT64 capacity = buffer_records();
+    FOR_X_IN_Y(t, threads){
+        BUFFER_RECORD* records = (BUFFER_RECORD*) (*t)->filling;
+        if(!records){ continue; }
+        UINT64 count = 0;
+        while(count < capacity && records[count].ins_data){ count++; }
+        simulate_buffer(FULL_BUFFER(*t, records, count));
+    }
+    PIN_ReleaseLock(&threads_lock);
+    PIN_ReleaseLock(&simulate_lock);
+}
+
+VOID PrepareForFini(VOID *v)
+{
+    if(sampling){
+        sample_switcher_running = false;
+        PIN_WaitForThreadTermination(sample_switcher_uid, PIN_INFINITE_TIMEOUT, NULL);
+    }
+    if(intervals){
+        interval_writer_running = false;
+        PIN_WaitForThreadTermination(interval_writer_uid, PIN_INFINITE_TIMEOUT, NULL);
+    }
+    if(buffer_id == BUFFER_ID_INVALID){ return; }
+    consumer_running = false;
+    PIN_WaitForThreadTermination(consumer_uid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
 INST_CAT set_instr_cat(INS ins, REG write_reg){
   if(INS_IsMemoryRead(ins) && !IS_FLOAT(regtype[write_reg]) && INS_Category(ins) == XED_CATEGORY_DATAXFER) { 
     return I_PURE_LOAD;
@@ -560,7 +1486,9 @@ INST_CAT set_instr_cat(INS ins, REG write_reg){
   }
 }
 
-VOID Instruction(INS ins, void *v){
+// Instrument the register ins writes, returns whether it is one we simulate.
+// Analysis calls are only inserted if simulate is set, fast-forwarding just counts.
+bool InstrumentRegister(INS ins, bool simulate){
     //Let's assume instructions only write to one register.
     // if the instruction does write to multiple registers, the one we care about 
     // is the last register it writes to whose type is in regtype.
@@ -573,86 +1501,530 @@ VOID Instruction(INS ins, void *v){
         if(!X_IN_Y(reg_iterate, regtype)){ continue; } //if not (reg_iterate in regtype)
         write_reg = reg_iterate;
     }
-    if(write_reg == REG_INVALID_){ return; }
+    if(write_reg == REG_INVALID_){ return false; }
     // Checks that we can attach instrumentation after instruction (e.g. no branch)
-    if(!INS_IsValidForIpointAfter(ins)){return;} //we want to insert the instrumentation after the instruction.
+    if(!INS_IsValidForIpointAfter(ins)){return false;} //we want to insert the instrumentation after the instruction.
     
     // pin does not support some addresses
-    if(REG_StringShort(write_reg).compare("mxcsr") == 0){return;}
-    else if (REG_StringShort(write_reg).compare("st0") == 0){return;}
-    else if (REG_StringShort(write_reg).compare("st1") == 0){return;}
-    else if (REG_StringShort(write_reg).compare("st2") == 0){return;}
-    else if (REG_StringShort(write_reg).compare("st3") == 0){return;}
+    if(REG_StringShort(write_reg).compare("mxcsr") == 0){return false;}
+    else if (REG_StringShort(write_reg).compare("st0") == 0){return false;}
+    else if (REG_StringShort(write_reg).compare("st1") == 0){return false;}
+    else if (REG_StringShort(write_reg).compare("st2") == 0){return false;}
+    else if (REG_StringShort(write_reg).compare("st3") == 0){return false;}
+
+    // Only the categories picked by -inst_cat are instrumented, UNKNOWN never is
+    INST_CAT flag = set_instr_cat(ins, write_reg);
+    if(!inst_cat_enabled[flag]){ return false; }
+
+    if(!simulate){ return true; }
 
     if(!X_IN_Y(INS_Address(ins), inst_data)){
-        inst_data[INS_Address(ins)] = new INST_DATA(ins);        
+        if(inst_by_id.size() >= LOCALITY_CHUNKS * LOCALITY_CHUNK_SIZE){ return false; } //out of locality table space
+        INST_DATA* ins_data = new INST_DATA(ins);
+        ins_data->id = inst_by_id.size();
+        inst_by_id.push_back(ins_data);
+        select_routines(ins_data);
+        if(snapshot_in.loaded()){ ins_data->saved = snapshot_in.find(INS_Address(ins)); }
+        inst_data[INS_Address(ins)] = ins_data;
     }
 
     // Set instruction category 
-    inst_data[INS_Address(ins)] -> flag = set_instr_cat(ins, write_reg);
+    inst_data[INS_Address(ins)] -> flag = flag;
 
 #ifndef DUMP_INSTS_USED
-    INS_InsertCall(ins, IPOINT_AFTER, (AFUNPTR) value_predict, 
-                        IARG_INST_PTR, 
-                        IARG_PTR, inst_data[INS_Address(ins)],  // data of this instruction
-                        IARG_REG_CONST_REFERENCE , write_reg, //pointer to register it writes to (PIN_REGISTER* )
-                        IARG_END); 
+    if(buffer_id == BUFFER_ID_INVALID){
+        INS_InsertCall(ins, IPOINT_AFTER, inst_data[INS_Address(ins)]->analysis, 
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_REG_VALUE, thread_reg,
+                            IARG_INST_PTR, 
+                            IARG_PTR, inst_data[INS_Address(ins)],  // data of this instruction
+                            IS_FLOAT(regtype[write_reg]) ? IARG_REG_CONST_REFERENCE : IARG_REG_VALUE, write_reg, //float registers by reference (PIN_REGISTER* ), the rest by value
+                            IARG_END); 
+    } else {
+        //The buffer only takes ADDRINT sized values, float registers go through the thread's ring
+        REG value_reg = write_reg;
+        if(IS_FLOAT(regtype[write_reg])){
+            INS_InsertCall(ins, IPOINT_AFTER, (AFUNPTR) capture_wide,
+                                IARG_FAST_ANALYSIS_CALL,
+                                IARG_REG_VALUE, thread_reg,
+                                IARG_REG_CONST_REFERENCE, write_reg,
+                                IARG_RETURN_REGS, wide_slot_reg,
+                                IARG_END);
+            value_reg = wide_slot_reg;
+        }
+        INS_InsertFillBuffer(ins, IPOINT_AFTER, buffer_id,
+                            IARG_INST_PTR, offsetof(BUFFER_RECORD, ins_ptr),
+                            IARG_PTR, inst_data[INS_Address(ins)], offsetof(BUFFER_RECORD, ins_data),
+                            IARG_REG_VALUE, value_reg, offsetof(BUFFER_RECORD, value),
+                            IARG_END);
+    }
+    return true;
+#else
+    return false;
 #endif 
 }
 
+// The INST_DATA of the memory operand of ins that flag predicts, bytes wide, created the first
+// time. NULL if the locality tables are full.
+INST_DATA* memory_inst_data(INS ins, INST_CAT flag, UINT32 bytes){
+    std::map<ADDRINT, INST_DATA*>& data = (flag == M_LOAD_ADDR) ? load_addr_data : store_value_data;
+    if(X_IN_Y(INS_Address(ins), data)){ return data[INS_Address(ins)]; }
+    if(inst_by_id.size() >= LOCALITY_CHUNKS * LOCALITY_CHUNK_SIZE){ return NULL; } //out of locality table space
+    INST_DATA* ins_data = new INST_DATA(ins, flag, bytes);
+    ins_data->id = inst_by_id.size();
+    inst_by_id.push_back(ins_data);
+    select_routines(ins_data);
+    data[INS_Address(ins)] = ins_data;
+    return ins_data;
+}
+
+// Instrument the memory operands of ins for the Stream=load and Stream=store VPUs: the address of its
+// first read, taken before it runs, and the value of its first write, read back from memory after
+// it. Returns whether ins has one we simulate. Gathers and scatters, whose operands Pin does not
+// pass this way, and stores that end a trace or are not of a register width are left out.
+// reg says whether InstrumentRegister simulates the register ins writes.
+bool InstrumentMemory(INS ins, bool simulate, bool reg){
+    if(!INS_IsStandardMemop(ins)){ return false; }
+    bool load = streams[STREAM_LOAD] && INS_IsMemoryRead(ins) && inst_cat_enabled[M_LOAD_ADDR];
+    UINT32 store_bytes = INS_IsMemoryWrite(ins) ? INS_MemoryWriteSize(ins) : 0;
+    bool store = streams[STREAM_STORE] && store_bytes && inst_cat_enabled[M_STORE_VALUE] && store_size_supported(store_bytes) && INS_IsValidForIpointAfter(ins);
+    if(!simulate){ return load || store; }
+
+#ifndef DUMP_INSTS_USED
+    INST_DATA* load_data = load ? memory_inst_data(ins, M_LOAD_ADDR, 8) : NULL;
+    if(load_data && buffer_id == BUFFER_ID_INVALID){
+        INS_InsertCall(ins, IPOINT_BEFORE, load_data->analysis,
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_REG_VALUE, thread_reg,
+                            IARG_INST_PTR,
+                            IARG_PTR, load_data,
+                            IARG_MEMORYREAD_EA,
+                            IARG_END);
+    } else if(load_data){
+        INS_InsertFillBuffer(ins, IPOINT_BEFORE, buffer_id,
+                            IARG_INST_PTR, offsetof(BUFFER_RECORD, ins_ptr),
+                            IARG_PTR, load_data, offsetof(BUFFER_RECORD, ins_data),
+                            IARG_MEMORYREAD_EA, offsetof(BUFFER_RECORD, value),
+                            IARG_END);
+    }
+
+    INST_DATA* store_data = store ? memory_inst_data(ins, M_STORE_VALUE, store_bytes) : NULL;
+    //The load is recorded before the instruction runs, the register before the store after it
+    if(load_data){
+        load_data->first = true;
+        if(reg){ inst_data[INS_Address(ins)]->first = false; }
+    }
+    if(store_data){ store_data->first = !reg && !load_data; }
+    if(store_data){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) save_store_ea,
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_REG_VALUE, thread_reg,
+                            IARG_MEMORYWRITE_EA,
+                            IARG_END);
+    }
+    if(store_data && buffer_id == BUFFER_ID_INVALID){
+        INS_InsertCall(ins, IPOINT_AFTER, store_data->analysis,
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_REG_VALUE, thread_reg,
+                            IARG_INST_PTR,
+                            IARG_PTR, store_data,
+                            IARG_END);
+    } else if(store_data){
+        //the value, or its slot in the thread's ring, goes to the buffer through store_value_reg
+        INS_InsertCall(ins, IPOINT_AFTER, capture_store_of(store_bytes),
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_REG_VALUE, thread_reg,
+                            IARG_RETURN_REGS, store_value_reg,
+                            IARG_END);
+        INS_InsertFillBuffer(ins, IPOINT_AFTER, buffer_id,
+                            IARG_INST_PTR, offsetof(BUFFER_RECORD, ins_ptr),
+                            IARG_PTR, store_data, offsetof(BUFFER_RECORD, ins_data),
+                            IARG_REG_VALUE, store_value_reg, offsetof(BUFFER_RECORD, value),
+                            IARG_END);
+    }
+    return load_data || store_data;
+#else
+    return false;
+#endif
+}
+
+// Instrument one instruction, returns whether it writes a value we simulate (and so is counted)
+bool Instruction(INS ins, bool simulate){
+    bool reg = InstrumentRegister(ins, simulate);
+    bool mem = mem_streams && InstrumentMemory(ins, simulate, reg);
+    return reg || mem;
+}
+
+// Count instructions a basic block at a time. The limit check is an inlined IfCall, only a full
+// batch reaches flush_batch.
+VOID Trace(TRACE trc, VOID *v){
+    bool simulate = !sampling || sample_phase != SAMPLE_FF;
+    for(BBL bbl = TRACE_BblHead(trc); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+        UINT32 insts = 0;
+        for(INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)){
+            if(Instruction(ins, simulate)){ insts++; }
+        }
+        if(!insts){ continue; }
+        BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR) count_block,
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_REG_VALUE, thread_reg,
+                            IARG_UINT32, insts,
+                            IARG_END);
+        BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR) flush_batch,
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_REG_VALUE, thread_reg,
+                            IARG_END);
+    }
+}
+
+
+/* ===================================================================== */
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    THREAD_DATA* td = new THREAD_DATA();
+    PIN_GetLock(&threads_lock, tid + 1);
+    if(shared_predictor || !vpus_taken){
+        td->vpus = vpus;
+        vpus_taken = true;
+    } else {
+        create_vpus(knob_config, vpu_specs, td->vpus); //already checked in main()
+    }
+    td->stats.resize(td->vpus.size());
+    if(dataflow_timing){
+        td->base_timing = new DATAFLOW();
+        for(UINT32 v = 0; v < td->vpus.size(); v++){ td->timing.push_back(new DATAFLOW()); }
+    }
+    threads.push_back(td);
+    PIN_ReleaseLock(&threads_lock);
+
+    if(buffer_id != BUFFER_ID_INVALID){
+        //Pin allocates the first buffer of every thread itself. Buffers start out cleared, see drain_buffers.
+        td->filling = PIN_GetBufferPointer(ctxt, buffer_id);
+        memset(td->filling, 0, buffer_records() * sizeof(BUFFER_RECORD));
+        for(UINT32 i = 1; i < BUFFERS_PER_THREAD; i++){
+            VOID* buffer = PIN_AllocateBuffer(buffer_id);
+            memset(buffer, 0, buffer_records() * sizeof(BUFFER_RECORD));
+            td->free_buffers.push_back(buffer);
+        }
+        td->wide_slots = (BUFFERS_PER_THREAD + 1) * (buffer_records() + 1);
+        td->wide_values = new_aligned_table<UINT8>(td->wide_slots * MAX_BYTES_PER_PIN_REG);
+    }
+    if(KnobHotPcs.Value()){ td->hot = new HOT_PROFILE(KnobHotPcs.Value() * HOT_SLACK, KnobHotValues.Value()); }
+    next_batch(td, insts_flushed);
+    PIN_SetThreadData(thread_key, td, tid);
+    PIN_SetContextReg(ctxt, thread_reg, (ADDRINT) td);
+}
+
+/* ===================================================================== */
+/* Child processes                                                       */
+/* ===================================================================== */
+// Pin keeps instrumenting a forked child, which starts with a copy of the tool's state. Before
+// the fork, buffered output is written so the child has none of it to write again.
+VOID ForkBefore(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    PIN_GetLock(&trace_lock, tid + 1);
+    if(!trace.closed){ trace.file.flush(); }
+    PIN_ReleaseLock(&trace_lock);
+}
+
+// The child is a process of its own: it counts from zero with empty VPUs and writes its own output
+// files (name.pid). Only the forking thread exists in the child, so locks other threads held are
+// reset, and the parent's trace, interval file and helper threads are left to the parent.
+VOID ForkChild(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    child_process = true;
+    PIN_InitLock(&threads_lock);
+    PIN_InitLock(&trace_lock);
+    PIN_InitLock(&print_lock);
+    THREAD_DATA* td = (THREAD_DATA*) PIN_GetThreadData(thread_key, tid);
+    threads.clear();
+    threads.push_back(td);
+    td->reset();
+    FOR_X_IN_Y(vpu, td->vpus){ (*vpu)->clear(); }
+    if(resumed){
+        delete resumed;
+        resumed = NULL;
+        resumed_insts = 0;
+    }
+    insts_flushed = 0;
+    limit_hit = false;
+
+    trace.closed = true; //the parent keeps recording
+    intervals = false;   //the interval writer thread only runs in the parent
+    if(snapshots){
+        PIN_InitLock(&snapshot_lock);
+        snapshot_end = KnobSnapshotEvery.Value();
+    }
+    if(sampling){
+        PIN_InitLock(&sample_lock);
+        windows.clear();
+        if(sample_phase == SAMPLE_MEASURE){
+            delete window_counts;
+            begin_window(0);
+        }
+        //the child switches its own phases, so it gets a switcher of its own
+        PIN_SemaphoreInit(&phase_switched);
+        if(PIN_SpawnInternalThread(sample_switcher, 0, 0, &sample_switcher_uid) == INVALID_THREADID){
+            cerr << "Cannot start the sample switcher thread in the child" << endl;
+        }
+    }
+    if(buffer_id != BUFFER_ID_INVALID){
+        //The consumer thread only runs in the parent, the child simulates its own buffers.
+        // Buffers queued by the parent go back to their threads unsimulated.
+        PIN_InitLock(&buffers_lock);
+        PIN_InitLock(&simulate_lock);
+        consumer_running = false;
+        FOR_X_IN_Y(full, full_buffers){
+            memset(full->records, 0, full->count * sizeof(BUFFER_RECORD));
+            full->td->free_buffers.push_back(full->records);
+        }
+        full_buffers.clear();
+    }
+    next_batch(td, 0);
+}
+
+// With Pin's -follow_execv, run the tool in programs the target execs with the same knobs.
+// Add -pid 1 so each process writes its own output file.
+BOOL FollowChild(CHILD_PROCESS child, VOID *v)
+{
+    return TRUE;
+}
+
 /* ===================================================================== */
 VOID Fini(int n, void *v)
 {
-    PrintResults(false);
+    if(buffer_id != BUFFER_ID_INVALID){ simulate_queued(); }
+    PrintResults(limit_hit);
 }
 
 /* ===================================================================== */
 int main(int argc, char *argv[])
 {
+#ifdef PROFILE
+    clock_gettime(CLOCK_MONOTONIC, &tool_start);
+#endif
     if( PIN_Init(argc,argv) )
     {
         return Usage();
     }
 
-    VPT_BITS = KnobTableSize.Value();       // Number of bits to use as VPT address
-    VPT_ENTRIES = POW(2, VPT_BITS);         // Length of VPT table
-    VPT_MASK = VPT_ENTRIES - 1;             // Mask for VPT address table
-    UINT8 ct_size = KnobCTSize.Value();     // CT table length, 0 = perfect
-    if (!ct_size) { CT_PERF = true; }
-    CT_ENTRIES = POW(2, ct_size); // Length of CT table
-    CT_MASK = CT_ENTRIES - 1;               // Mask for CT table
-    CT_BITS = KnobCTbits.Value();     // Size of prediction in bits
-    CT_MAX = POW(2, CT_BITS) - 1;     // Size of prediction
-    // Set the prediction thresholds. CT_BITS = 0 will always make prediction
-    // From Table 3 Lipasti
-    switch(CT_BITS) {
-      case 0:
-        CT_MAX = 0;
-        CT_PRED_TH = 0;
-        CT_REP_TH = 0;
-        break;
-      case 1:
-        CT_PRED_TH = 1;
-        CT_REP_TH = 1;
-        break;
-      case 2:
-        CT_PRED_TH = 2;
-        CT_REP_TH = 3;
-        break;
-      case 3:
-        CT_PRED_TH = 2;
-        CT_REP_TH = 5;
-        break;
-      default:
-        CT_PRED_TH = POW(2, CT_BITS - 1);      // Threshold to use for prediction CT_Max/2
-        CT_REP_TH = CT_MAX;
-    }
-
-    insts_executed = 0;
+    //The single configuration given by the knobs, which -config entries override
+    knob_config.size = KnobTableSize.Value();
+    knob_config.CTsize = KnobCTSize.Value();
+    knob_config.CTbits = KnobCTbits.Value();
+    knob_config.HistDepth = KnobHistDepth.Value();
+    knob_config.VictimCache = KnobVictimCache.Value();
+    if(!parse_pred_type(KnobPredType.Value(), knob_config.PredType)){
+        cerr << "Unknown -PredType " << KnobPredType.Value() << endl;
+        return Usage();
+    }
+    knob_config.FCMorder = KnobFCMorder.Value();
+    knob_config.Fingerprint = KnobFingerprint.Value();
+    knob_config.VPTways = KnobVPTways.Value();
+    if(!parse_vpt_repl(KnobVPTrepl.Value(), knob_config.VPTrepl)){
+        cerr << "Unknown -VPTrepl " << KnobVPTrepl.Value() << endl;
+        return Usage();
+    }
+    if(!parse_ct_index(KnobCTindex.Value(), knob_config.CTindex)){
+        cerr << "Unknown -CTindex " << KnobCTindex.Value() << endl;
+        return Usage();
+    }
+    dataflow_timing = KnobTiming.Value();
+    issue_width = KnobIssueWidth.Value();
+    vp_penalty = KnobVPPenalty.Value();
+
+    for(UINT32 i = 0; i < KnobConfig.NumberOfValues(); i++){
+        if(!KnobConfig.Value(i).empty()){ vpu_specs.push_back(KnobConfig.Value(i)); }
+    }
+    if(!KnobConfigFile.Value().empty() && !read_config_file(KnobConfigFile.Value(), vpu_specs)){
+        cerr << "Cannot open config file " << KnobConfigFile.Value() << endl;
+        return Usage();
+    }
+    if(KnobMemValues.Value()){
+        //every configuration again on the load addresses, then again on the store values
+        if(vpu_specs.empty()){ vpu_specs.push_back(""); }
+        UINT32 reg_specs = vpu_specs.size();
+        for(UINT32 i = 0; i < reg_specs; i++){ vpu_specs.push_back(vpu_specs[i] + ",Stream=load"); }
+        for(UINT32 i = 0; i < reg_specs; i++){ vpu_specs.push_back(vpu_specs[i] + ",Stream=store"); }
+    }
+    //VPUs loaded from a snapshot get its tables instead of allocating their own
+    string error = create_vpus(knob_config, vpu_specs, vpus, KnobSnapshotIn.Value().empty());
+    if(!error.empty()){
+        cerr << error << endl;
+        return Usage();
+    }
+    vpus_kernel = vpus[0]->KERNEL;
+    FOR_X_IN_Y(vpu, vpus){
+        if((*vpu)->KERNEL != vpus_kernel){ vpus_kernel = KERNEL_MIXED; }
+        streams[(*vpu)->STREAM] = true;
+        if((*vpu)->STREAM != STREAM_REG){ mem_streams = true; }
+    }
+
+    if(!KnobSnapshotIn.Value().empty()){
+        error = snapshot_in.open(KnobSnapshotIn.Value());
+        if(error.empty() && snapshot_in.header->vpus != vpus.size()){ error = "The snapshot does not have the same configurations as this run"; }
+        for(UINT32 v = 0; v < vpus.size() && error.empty(); v++){ error = snapshot_in.restore(*vpus[v], v); }
+        if(!error.empty()){
+            cerr << error << endl;
+            return Usage();
+        }
+        if(KnobResume.Value()){
+            resumed = new SAMPLE_COUNTS();
+            memcpy(resumed->prev_per_category, snapshot_in.header->prev_per_category, sizeof(resumed->prev_per_category));
+            memcpy(resumed->hit_per_category, snapshot_in.header->hit_per_category, sizeof(resumed->hit_per_category));
+            for(UINT32 v = 0; v < vpus.size(); v++){ resumed->stats[v] = snapshot_in.vpus[v].stats; }
+            resumed_insts = snapshot_in.header->insts_executed;
+        }
+    } else if(KnobResume.Value()){
+        cerr << "resume needs snapshot_in" << endl;
+        return Usage();
+    }
+
+    if(KnobHotValues.Value() < 1 || KnobHotValues.Value() > HOT_MAX_VALUES){
+        cerr << "hot_values must be 1 to " << HOT_MAX_VALUES << endl;
+        return Usage();
+    }
+
+    if(!parse_inst_cat(KnobInstCat.Value())){
+        cerr << "Unknown instruction category in " << KnobInstCat.Value() << endl;
+        return Usage();
+    }
+
+    if(KnobPredictor.Value() == "shared"){
+        shared_predictor = true;
+        FOR_X_IN_Y(vpu, vpus){ (*vpu)->make_shared(); }
+    } else if(KnobPredictor.Value() != "private"){
+        cerr << "predictor must be private or shared" << endl;
+        return Usage();
+    }
+
+    PIN_InitLock(&threads_lock);
+    PIN_InitLock(&trace_lock);
+    PIN_InitLock(&print_lock);
+
+    if(KnobSampleFF.Value() || !KnobSimPoints.Value().empty()){
+        if(!KnobSimPoints.Value().empty()){
+            std::ifstream in(KnobSimPoints.Value().c_str());
+            if(!in){
+                cerr << "Cannot open simpoints file " << KnobSimPoints.Value() << endl;
+                return Usage();
+            }
+            string line;
+            while(std::getline(in, line)){
+                line = line.substr(0, line.find('#'));
+                std::istringstream ss(line);
+                UINT64 start;
+                if(ss >> start){ simpoints.push_back(start); }
+            }
+            std::sort(simpoints.begin(), simpoints.end());
+        }
+        if(KnobBufferPages.Value()){
+            cerr << "Sampling does not work with buffer_pages" << endl;
+            return Usage();
+        }
+        sampling = true;
+        PIN_InitLock(&sample_lock);
+        if(!next_window(0)){
+            cerr << "No windows in " << KnobSimPoints.Value() << endl;
+            return Usage();
+        }
+        //no fast-forward or warm-up before the first window
+        if(sample_end == 0){ sample_phase = SAMPLE_WARMUP; sample_end = measure_at; }
+        if(sample_end == 0){
+            sample_phase = SAMPLE_MEASURE;
+            sample_end = KnobSampleMeasure.Value();
+            begin_window(0);
+        }
+        PIN_SemaphoreInit(&phase_switched);
+        sample_switcher_running = true;
+        if(PIN_SpawnInternalThread(sample_switcher, 0, 0, &sample_switcher_uid) == INVALID_THREADID){
+            cerr << "Cannot start the sample switcher thread" << endl;
+            return Usage();
+        }
+    }
+
+    if(KnobInterval.Value()){
+        if(KnobBufferPages.Value()){
+            cerr << "Intervals do not work with buffer_pages" << endl;
+            return Usage();
+        }
+        interval_out.open(KnobIntervalOut.Value().c_str());
+        if(!interval_out){
+            cerr << "Cannot open interval file " << KnobIntervalOut.Value() << endl;
+            return Usage();
+        }
+        write_interval_header();
+        intervals = true;
+        PIN_InitLock(&interval_lock);
+        PIN_InitLock(&interval_out_lock);
+        PIN_SemaphoreInit(&intervals_ready);
+        interval_counts = new SAMPLE_COUNTS();
+        take_counts(*interval_counts); //only the resumed counts, so they are not in the first interval
+        interval_end = KnobInterval.Value();
+        interval_writer_running = true;
+        if(PIN_SpawnInternalThread(interval_writer, 0, 0, &interval_writer_uid) == INVALID_THREADID){
+            cerr << "Cannot start the interval writer thread" << endl;
+            return Usage();
+        }
+    }
+
+    if(KnobSnapshotEvery.Value()){
+        if(KnobSnapshotOut.Value().empty()){
+            cerr << "snapshot_every needs snapshot_out" << endl;
+            return Usage();
+        }
+        snapshots = true;
+        PIN_InitLock(&snapshot_lock);
+        snapshot_end = KnobSnapshotEvery.Value();
+    }
+
+    if(!KnobAggregate.Value().empty()){
+        error = agg_attach(KnobAggregate.Value(), vpus, aggregate);
+        if(!error.empty()){
+            cerr << error << endl;
+            return Usage();
+        }
+    }
+
+    if(!KnobTraceOut.Value().empty() && !trace.open(KnobTraceOut.Value())){
+        cerr << "Cannot open trace file " << KnobTraceOut.Value() << endl;
+        return Usage();
+    }
+
+    insts_flushed = 0;
+    thread_key = PIN_CreateThreadDataKey(NULL);
+    thread_reg = PIN_ClaimToolRegister();
+    if(!REG_valid(thread_reg)){
+        cerr << "Cannot allocate a tool register" << endl;
+        return Usage();
+    }
     populate_regs();
 
-    INS_AddInstrumentFunction(Instruction, 0);
+    if(KnobBufferPages.Value()){
+        buffer_id = PIN_DefineTraceBuffer(sizeof(BUFFER_RECORD), KnobBufferPages.Value(), buffer_full, 0);
+        wide_slot_reg = PIN_ClaimToolRegister();
+        store_value_reg = mem_streams ? PIN_ClaimToolRegister() : wide_slot_reg;
+        if(buffer_id == BUFFER_ID_INVALID || !REG_valid(wide_slot_reg) || !REG_valid(store_value_reg)){
+            cerr << "Cannot allocate the value buffers" << endl;
+            return Usage();
+        }
+        PIN_InitLock(&buffers_lock);
+        PIN_InitLock(&simulate_lock);
+        PIN_SemaphoreInit(&buffers_ready);
+        consumer_running = true;
+        if(PIN_SpawnInternalThread(consumer, 0, 0, &consumer_uid) == INVALID_THREADID){
+            cerr << "Cannot start the consumer thread" << endl;
+            return Usage();
+        }
+    }
+
+    TRACE_AddInstrumentFunction(Trace, 0);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
+    PIN_AddForkFunction(FPOINT_BEFORE, ForkBefore, 0);
+    PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, ForkChild, 0);
+    PIN_AddFollowChildProcessFunction(FollowChild, 0);
 
     PIN_StartProgram();
 
@@ -0,0 +1,202 @@
+// Replay simulator: runs the Value Prediction Unit over a value trace recorded with the pintool's
+// -trace_out knob, without Pin or the target program. It takes the same VPU and timing knobs as
+// the pintool and appends the same results (LOCALITY DATA / VPT SETTINGS / DATAFLOW TIMING blocks)
+// to its output file. The timing model runs over the trace as one thread.
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <unordered_map>
+#include "vpu.h"
+#include "trace.h"
+
+using std::cerr;
+using std::string;
+using std::endl;
+
+// The replay counterpart of the pintool's INST_DATA: value locality of one static instruction
+class REPLAY_INST {
+public:
+    UINT64 hit_count; //number of times the instruction has been executed.
+    UINT64 prev_seen; // number of times the data matched previous execution
+    regval last_value_seen; //What's the last value stored to the out register?
+    INST_CAT flag;
+};
+
+static int Usage()
+{
+    cerr << "This program replays a value trace through the value prediction unit\n";
+    cerr << "usage: replay -trace FILE [-outfile FILE] [-size N] [-CTsize N] [-CTbits N]\n"
+         << "              [-HistDepth N] [-VictimCache N] [-PredType TYPE] [-FCMorder N]\n"
+         << "              [-Fingerprint 0|1] [-VPTways N] [-VPTrepl lru|plru|random]\n"
+         << "              [-CTindex pc|xor|gshare|tagged] [-mem_values 0|1]\n"
+         << "              [-timing 0|1] [-issue_width N] [-vp_penalty N]\n"
+         << "              [-config SPEC]... [-config_file FILE]\n";
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    //Same defaults as the pintool knobs
+    string trace_file;
+    string output_file = "replay.out";
+    string config_file;
+    std::vector<string> specs;
+    VPU_CONFIG knob_config;
+    knob_config.size = 8;
+    knob_config.CTsize = 8;
+    knob_config.CTbits = 1;
+    knob_config.HistDepth = 1;
+    knob_config.VictimCache = 0;
+    knob_config.PredType = VP_LAST;
+    knob_config.FCMorder = 2;
+    knob_config.Fingerprint = 0;
+    knob_config.VPTways = 1;
+    knob_config.VPTrepl = REPL_LRU;
+    knob_config.CTindex = CT_PC;
+    knob_config.Stream = STREAM_REG;
+    bool mem_values = false;
+    bool dataflow_timing = true;
+    UINT32 issue_width = 4;
+    UINT32 vp_penalty = 10;
+
+    for(int i = 1; i < argc; i += 2){
+        if(i + 1 >= argc){ return Usage(); }
+        string knob = argv[i];
+        string value = argv[i + 1];
+        if(knob == "-trace"){ trace_file = value; }
+        else if(knob == "-outfile"){ output_file = value; }
+        else if(knob == "-config"){ specs.push_back(value); }
+        else if(knob == "-config_file"){ config_file = value; }
+        else if(knob == "-size"){ knob_config.size = strtoul(value.c_str(), NULL, 0); }
+        else if(knob == "-CTsize"){ knob_config.CTsize = strtoul(value.c_str(), NULL, 0); }
+        else if(knob == "-CTbits"){ knob_config.CTbits = strtoul(value.c_str(), NULL, 0); }
+        else if(knob == "-HistDepth"){ knob_config.HistDepth = strtoul(value.c_str(), NULL, 0); }
+        else if(knob == "-VictimCache"){ knob_config.VictimCache = strtoul(value.c_str(), NULL, 0); }
+        else if(knob == "-PredType"){ if(!parse_pred_type(value, knob_config.PredType)){ return Usage(); } }
+        else if(knob == "-FCMorder"){ knob_config.FCMorder = strtoul(value.c_str(), NULL, 0); }
+        else if(knob == "-Fingerprint"){ knob_config.Fingerprint = strtoul(value.c_str(), NULL, 0); }
+        else if(knob == "-VPTways"){ knob_config.VPTways = strtoul(value.c_str(), NULL, 0); }
+        else if(knob == "-VPTrepl"){ if(!parse_vpt_repl(value, knob_config.VPTrepl)){ return Usage(); } }
+        else if(knob == "-CTindex"){ if(!parse_ct_index(value, knob_config.CTindex)){ return Usage(); } }
+        else if(knob == "-mem_values"){ mem_values = strtoul(value.c_str(), NULL, 0) != 0; }
+        else if(knob == "-timing"){ dataflow_timing = strtoul(value.c_str(), NULL, 0) != 0; }
+        else if(knob == "-issue_width"){ issue_width = strtoul(value.c_str(), NULL, 0); }
+        else if(knob == "-vp_penalty"){ vp_penalty = strtoul(value.c_str(), NULL, 0); }
+        else { return Usage(); }
+    }
+    if(trace_file.empty()){ return Usage(); }
+    if(!config_file.empty() && !read_config_file(config_file, specs)){
+        cerr << "Cannot open config file " << config_file << endl;
+        return Usage();
+    }
+    if(mem_values){
+        //every configuration again on the load addresses, then on the store values, as the pintool does
+        if(specs.empty()){ specs.push_back(""); }
+        UINT32 reg_specs = specs.size();
+        for(UINT32 i = 0; i < reg_specs; i++){ specs.push_back(specs[i] + ",Stream=load"); }
+        for(UINT32 i = 0; i < reg_specs; i++){ specs.push_back(specs[i] + ",Stream=store"); }
+    }
+    std::vector<VPU*> vpus;
+    string error = create_vpus(knob_config, specs, vpus);
+    if(!error.empty()){
+        cerr << error << endl;
+        return Usage();
+    }
+    std::vector<VPU_STATS> stats(vpus.size());
+
+    //Map the whole trace, blocks are decompressed straight out of the mapping
+    int fd = open(trace_file.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0){
+        cerr << "Cannot open trace file " << trace_file << endl;
+        return -1;
+    }
+    const UINT8* data = (const UINT8*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED){
+        cerr << "Cannot map trace file " << trace_file << endl;
+        return -1;
+    }
+    madvise((void*) data, st.st_size, MADV_SEQUENTIAL);
+
+    TRACE_READER reader;
+    error = reader.attach(data, st.st_size);
+    if(!error.empty()){
+        cerr << trace_file << ": " << error << endl;
+        return -1;
+    }
+
+    //Same per value work as value_predict in the pintool
+    //One map per category, as one instruction can write a register, load and store
+    std::unordered_map<ADDRINT, REPLAY_INST> inst_data[CATEGORIES];
+    UINT64 insts_executed = 0;
+    //The dataflow registers of each instruction writing a register, and the timing of the trace
+    //without value prediction and with the predictions of each VPU
+    std::unordered_map<ADDRINT, const TRACE_INST*> dataflow;
+    for(UINT64 i = 0; i < reader.footer->insts; i++){ dataflow[reader.insts[i].ip] = &reader.insts[i]; }
+    DATAFLOW base_timing;
+    std::vector<DATAFLOW> timing(dataflow_timing ? vpus.size() : 0);
+    for(UINT64 b = 0; b < reader.footer->blocks; b++){
+        bool ok = reader.for_each_record(b, [&](ADDRINT ins_ptr, INST_CAT flag, RT datatype, const regval& value_to_write, bool first){
+            if(first){ insts_executed++; } //an instruction's other records are not counted again
+            UINT32 stream = stream_of(flag);
+            REPLAY_INST& ins_data = inst_data[flag][ins_ptr];
+            if(!ins_data.hit_count){ ins_data.last_value_seen.real_type = datatype; }
+            ins_data.hit_count++;
+            ins_data.flag = flag;
+
+            if(value_to_write == ins_data.last_value_seen){
+                ins_data.prev_seen++;
+            }
+            ins_data.last_value_seen = value_to_write;
+
+            //the dataflow model only follows registers
+            const TRACE_INST* df = NULL;
+            if(dataflow_timing && stream == STREAM_REG){
+                auto found = dataflow.find(ins_ptr);
+                if(found != dataflow.end()){ df = found->second; }
+            }
+            UINT64 base_added = 0;
+            if(df){ base_added = base_timing.step(df->srcs, df->num_srcs, df->dst, PRED_NONE, issue_width, vp_penalty); }
+
+            for(UINT32 v = 0; v < vpus.size(); v++){
+                if(vpus[v]->STREAM != stream){ continue; }
+                PREDICTION prediction = vpus[v]->predict(ins_ptr, value_to_write, datatype, flag, stats[v]);
+                if(df){
+                    stats[v].base_cycles += base_added;
+                    stats[v].vp_cycles += timing[v].step(df->srcs, df->num_srcs, df->dst, prediction, issue_width, vp_penalty);
+                }
+            }
+        });
+        if(!ok){
+            cerr << trace_file << ": corrupt block " << b << endl;
+            return -1;
+        }
+    }
+
+    //Aggregates the value locality statistics from all instructions that have flag set.
+    UINT64 prev_per_category[CATEGORIES] = {0};
+    UINT64 hit_per_category[CATEGORIES] = {0};
+    for(UINT32 c = 1; c < CATEGORIES; c++){
+        for(auto i = inst_data[c].begin(); i != inst_data[c].end(); i++){
+            prev_per_category[c] += i->second.prev_seen;
+            hit_per_category[c] += i->second.hit_count;
+        }
+    }
+
+    std::ofstream out(output_file.c_str(), std::ios_base::app);
+    out << "Instruction total| " << insts_executed << endl;
+    if(reader.footer->limit_reached)
+        out << "Reason| limit reached\n";
+    else
+        out << "Reason| fini\n";
+    if(dataflow_timing){
+        out << "Issue width| " << issue_width << endl;
+        out << "VP penalty| " << vp_penalty << endl;
+    }
+    print_vpu_results(out, vpus, stats, prev_per_category, hit_per_category);
+
+    munmap((void*) data, st.st_size);
+    close(fd);
+    return 0;
+}
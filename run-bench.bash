@@ -0,0 +1,126 @@
+#!/bin/bash -e
+#
+# Benchmark suite: runs the pintool over the bundled kernels (benchkernels.cpp) with a standard
+# set of knobs and records how much it slows each kernel down, then compares that with a stored
+# baseline so tool regressions show up on any machine with Pin. Run through `make bench`.
+#
+# Every row of the results file is KERNEL|CONFIG|NATIVE_S|PIN_S|SLOWDOWN|MIPS, where MIPS is the
+# instructions the tool simulated (its Instruction total) per second of the instrumented run.
+# Times are the best of -r runs.
+
+usage() {
+	echo "Usage: $0 TOOL KERNELS [-o RESULTS] [-b BASELINE] [-u] [-t PERCENT] [-r REPEATS] [-s SCALE]" 1>&2
+	echo "  TOOL      the pintool, e.g. obj-intel64/main.so" 1>&2
+	echo "  KERNELS   the benchkernels program, e.g. obj-intel64/benchkernels" 1>&2
+	echo "  -o        results file (default bench-results.txt)" 1>&2
+	echo "  -b        baseline to compare with (default bench-baseline.txt)" 1>&2
+	echo "  -u        make these results the new baseline" 1>&2
+	echo "  -t        slowdown increase that counts as a regression, in percent (default 10)" 1>&2
+	echo "  -r        runs of each measurement, the fastest counts (default 3)" 1>&2
+	echo "  -s        kernel scale (default 1)" 1>&2
+	exit 1
+}
+
+[[ $# -ge 2 ]] || usage
+declare tool=$1
+declare kernels=$2
+shift 2
+declare results=bench-results.txt
+declare baseline=bench-baseline.txt
+declare update=0
+declare threshold=10
+declare repeats=3
+declare scale=1
+while getopts "o:b:ut:r:s:" opt; do
+	case $opt in
+		o) results=$OPTARG ;;
+		b) baseline=$OPTARG ;;
+		u) update=1 ;;
+		t) threshold=$OPTARG ;;
+		r) repeats=$OPTARG ;;
+		s) scale=$OPTARG ;;
+		*) usage ;;
+	esac
+done
+
+export PIN_ROOT=${PIN_ROOT:-/opt/intel/pin}
+export PATH=$PIN_ROOT:$PATH
+
+declare -a KERNEL_NAMES=(pointer_chase strided stencil hash branchy)
+
+# The knob matrix: name and pintool knobs of each configuration
+declare -a CONFIG_NAMES=(default size12 depth4_vc hybrid buffered sweep)
+declare -a CONFIG_KNOBS=(
+	""
+	"-size 12 -CTsize 12 -CTbits 2"
+	"-HistDepth 4 -VictimCache 64 -CTbits 2"
+	"-PredType hybrid"
+	"-buffer_pages 64"
+	"-config size=8 -config size=10 -config size=12"
+)
+
+declare workdir
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+
+# Best wall clock seconds of running "$@" $repeats times. Fails if any run fails, so a broken run
+# never yields a time (-e does not reach into the $(...) this is called from, the caller checks).
+best_time() {
+	local best=""
+	for ((i = 0; i < repeats; i++)); do
+		local start end
+		start=$(date +%s.%N)
+		if ! "$@" > /dev/null; then
+			echo "Run failed: $*" 1>&2
+			return 1
+		fi
+		end=$(date +%s.%N)
+		best=$(awk -v s="$start" -v e="$end" -v b="$best" 'BEGIN { t = e - s; if (b == "" || t < b) b = t; printf "%.4f", b }')
+	done
+	echo "$best"
+}
+
+echo "KERNEL|CONFIG|NATIVE_S|PIN_S|SLOWDOWN|MIPS" > "$results"
+for kernel in "${KERNEL_NAMES[@]}"; do
+	native=$(best_time "$kernels" "$kernel" "$scale") || exit 1
+	for c in "${!CONFIG_NAMES[@]}"; do
+		out="$workdir/$kernel.${CONFIG_NAMES[$c]}.out"
+		# the tool appends to its output, every run starts from an empty file
+		# shellcheck disable=SC2086
+		instrumented=$(best_time bash -c 'rm -f "$0"; pin -t "$1" -outfile "$0" '"${CONFIG_KNOBS[$c]}"' -- "$2" "$3" "$4"' \
+			"$out" "$tool" "$kernels" "$kernel" "$scale") || exit 1
+		insts=$(awk -F'|' '/^Instruction total/ { n = $2 } END { print n + 0 }' "$out" 2> /dev/null) || insts=0
+		if [[ -z $insts || $insts == 0 ]]; then
+			echo "No Instruction total in $out, the tool did not finish $kernel ${CONFIG_NAMES[$c]}" 1>&2
+			exit 1
+		fi
+		awk -v k="$kernel" -v c="${CONFIG_NAMES[$c]}" -v n="$native" -v p="$instrumented" -v i="$insts" \
+			'BEGIN { printf "%s|%s|%.4f|%.4f|%.1f|%.2f\n", k, c, n, p, (n > 0 ? p / n : 0), (p > 0 ? i / p / 1e6 : 0) }' >> "$results"
+		tail -n 1 "$results"
+	done
+done
+
+if [[ $update == 1 ]]; then
+	cp "$results" "$baseline"
+	echo "Baseline $baseline updated"
+	exit 0
+fi
+if [[ ! -f $baseline ]]; then
+	echo "No baseline $baseline to compare with, make one with -u"
+	exit 0
+fi
+
+# A row regressed if its slowdown grew by more than threshold percent over the baseline's
+awk -F'|' -v t="$threshold" '
+	FNR == 1 { next }
+	NR == FNR { base[$1 "|" $2] = $5; next }
+	!(($1 "|" $2) in base) { printf "NEW        %s %s slowdown %s\n", $1, $2, $5; next }
+	{
+		b = base[$1 "|" $2]
+		change = (b > 0) ? ($5 / b - 1) * 100 : 0
+		status = (change > t) ? "REGRESSION" : "ok"
+		if (change > t) { failed = 1 }
+		printf "%-10s %s %s slowdown %s -> %s (%+.1f%%)\n", status, $1, $2, b, $5, change
+	}
+	END { exit failed }
+' "$baseline" "$results"
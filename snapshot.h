@@ -0,0 +1,324 @@
+// Predictor snapshot: the complete state of a set of VPUs, their statistics and the value locality
+// of every static instruction, written by the pintool's -snapshot_out knob and mapped back in by
+// -snapshot_in to warm-start or resume a later run.
+//
+// File layout:
+//   SNAPSHOT_HEADER
+//   one SNAPSHOT_VPU per VPU
+//   per VPU, each section starting on a page boundary:
+//     VPT (VPT_ENTRIES VPT_ENTRY), CT (CT_ENTRIES CT_ENTRY), CT owners (CT_ENTRIES UINT32),
+//     value history slabs (SLABS * SLAB_BYTES),
+//     victim cache nodes and index, FCM table (FCM and hybrid only), set tags and replacement
+//     state (VPTways > 1 only), used part of the WIDE_ARENA
+//   SNAPSHOT_INST records, sorted by ins_ptr
+// The tables are written exactly as they are in memory. They hold slab numbers and arena offsets
+// rather than pointers, so loading maps the file and points the VPUs at it: pages are only read
+// when the simulation first touches them, and nothing is parsed or allocated per entry.
+// A snapshot is only valid for the same build (the layout sizes are checked) and the same
+// configurations.
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <vector>
+#include "vpu.h"
+
+#define SNAPSHOT_MAGIC "VPUSNAP"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_ALIGN 4096
+
+class SNAPSHOT_HEADER {
+public:
+  char magic[8];
+  UINT32 version;
+  UINT32 vpus;
+  // sizes of the structures written as they are, a mismatch means another build wrote the file
+  UINT32 vpt_entry_bytes;
+  UINT32 vc_node_bytes;
+  UINT32 stats_bytes;
+  UINT32 inst_bytes;
+  UINT32 ct_entry_bytes;
+  UINT32 pad;
+  UINT64 insts_executed;  // instructions simulated by all the runs leading to this snapshot
+  UINT64 prev_per_category[CATEGORIES]; // value locality, as in the LOCALITY DATA blocks
+  UINT64 hit_per_category[CATEGORIES];
+  UINT64 inst_offset;     // file offset of the SNAPSHOT_INST records
+  UINT64 inst_count;
+  UINT64 file_bytes;
+};
+
+// Where one VPU's tables are in the file, and the state that is not in the tables
+class SNAPSHOT_VPU {
+public:
+  VPU_CONFIG config;
+  UINT32 vc_size;
+  UINT32 vc_mru;
+  UINT32 vc_lru;
+  UINT32 vc_free_head;
+  UINT64 vpt_offset;
+  UINT64 ct_offset;
+  UINT64 ct_owner_offset;
+  UINT64 ct_history;
+  UINT64 slab_offset;
+  UINT64 vc_node_offset;
+  UINT64 vc_index_offset;
+  UINT64 fcm_offset;      // 0 without an FCM table
+  UINT64 tags_offset;     // 0 with a direct mapped VPT
+  UINT64 repl_offset;
+  UINT64 repl_random;
+  UINT64 wide_offset;
+  UINT64 wide_used;       // bytes of the WIDE_ARENA in use
+  VPU_STATS stats;        // statistics of this configuration, summed over the threads
+};
+
+// Value locality of one static instruction
+class SNAPSHOT_INST {
+public:
+  UINT64 ins_ptr;
+  UINT64 hit_count;
+  UINT64 prev_seen;
+  UINT64 last_value;      // last int value written, 0 for float registers
+  UINT32 flag;            // INST_CAT
+  UINT32 pad;
+};
+
+inline UINT64 snapshot_align(UINT64 offset){ return (offset + SNAPSHOT_ALIGN - 1) & ~(UINT64) (SNAPSHOT_ALIGN - 1); }
+
+/* ===================================================================== */
+/* Writer                                                                */
+/* ===================================================================== */
+// Write vpus, with stats[v] the statistics of vpus[v], the run totals in header (only its counts
+// are used) and the per instruction records insts (sorted by ins_ptr) to path. The file is written
+// next to path and renamed over it, so an interrupted write never leaves a torn snapshot.
+// The tables are copied while other threads may still update them, so a snapshot taken during the
+// run is only consistent per entry. Returns an error message, empty on success.
+inline std::string write_snapshot(const std::string& path, const std::vector<VPU*>& vpus, const std::vector<VPU_STATS>& stats,
+                                  const SNAPSHOT_HEADER& counts, const std::vector<SNAPSHOT_INST>& insts){
+    SNAPSHOT_HEADER header = counts;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.vpus = vpus.size();
+    header.vpt_entry_bytes = sizeof(VPT_ENTRY);
+    header.vc_node_bytes = sizeof(VIC_CACHE::NODE);
+    header.stats_bytes = sizeof(VPU_STATS);
+    header.inst_bytes = sizeof(SNAPSHOT_INST);
+    header.ct_entry_bytes = sizeof(CT_ENTRY);
+    header.pad = 0;
+
+    //Lay out the sections first, the headers go in front of them
+    std::vector<SNAPSHOT_VPU> entries(vpus.size());
+    UINT64 offset = snapshot_align(sizeof(SNAPSHOT_HEADER) + vpus.size() * sizeof(SNAPSHOT_VPU));
+    for(UINT32 v = 0; v < vpus.size(); v++){
+        const VPU* vpu = vpus[v];
+        SNAPSHOT_VPU& e = entries[v];
+        e.config = vpu->config;
+        e.vc_size = vpu->viccache.size;
+        e.vc_mru = vpu->viccache.mru;
+        e.vc_lru = vpu->viccache.lru;
+        e.vc_free_head = vpu->viccache.free_head;
+        e.wide_used = vpu->arena.used;
+        e.stats = stats[v];
+        e.vpt_offset = offset;
+        offset = snapshot_align(offset + (UINT64) vpu->VPT_ENTRIES * sizeof(VPT_ENTRY));
+        e.ct_offset = offset;
+        offset = snapshot_align(offset + (UINT64) vpu->CT_ENTRIES * sizeof(CT_ENTRY));
+        e.ct_owner_offset = offset;
+        offset = snapshot_align(offset + (UINT64) vpu->CT_ENTRIES * sizeof(UINT32));
+        e.ct_history = vpu->ct_history;
+        e.slab_offset = offset;
+        offset = snapshot_align(offset + (UINT64) vpu->SLABS * vpu->SLAB_BYTES);
+        e.vc_node_offset = offset;
+        offset = snapshot_align(offset + (UINT64) vpu->viccache.capacity * sizeof(VIC_CACHE::NODE));
+        e.vc_index_offset = offset;
+        offset = snapshot_align(offset + (vpu->viccache.capacity ? (UINT64) (vpu->viccache.index_mask + 1) * sizeof(UINT32) : 0));
+        e.fcm_offset = 0;
+        if(vpu->fcm){
+            e.fcm_offset = offset;
+            offset = snapshot_align(offset + (UINT64) vpu->VPT_ENTRIES * sizeof(UINT64));
+        }
+        e.tags_offset = 0;
+        e.repl_offset = 0;
+        e.repl_random = vpu->repl_random;
+        if(vpu->vpt_tags){
+            e.tags_offset = offset;
+            offset = snapshot_align(offset + (UINT64) vpu->VPT_ENTRIES * sizeof(UINT64));
+            e.repl_offset = offset;
+            offset = snapshot_align(offset + (UINT64) vpu->VPT_SETS * sizeof(UINT64));
+        }
+        e.wide_offset = offset;
+        offset = snapshot_align(offset + e.wide_used);
+    }
+    header.inst_offset = offset;
+    header.inst_count = insts.size();
+    header.file_bytes = offset + insts.size() * sizeof(SNAPSHOT_INST);
+
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if(!f){ return "Cannot open snapshot file " + tmp; }
+    bool ok = true;
+    // Write bytes at offset, padding with zeros up to it
+    auto put = [&](UINT64 at, const void* data, UINT64 bytes){
+        static const UINT8 zeros[SNAPSHOT_ALIGN] = {0};
+        UINT64 pos = ftell(f);
+        while(ok && pos < at){
+            UINT64 pad = at - pos < SNAPSHOT_ALIGN ? at - pos : SNAPSHOT_ALIGN;
+            ok = fwrite(zeros, 1, pad, f) == pad;
+            pos += pad;
+        }
+        if(ok && bytes){ ok = fwrite(data, 1, bytes, f) == bytes; }
+    };
+    put(0, &header, sizeof(header));
+    put(sizeof(header), entries.data(), entries.size() * sizeof(SNAPSHOT_VPU));
+    for(UINT32 v = 0; v < vpus.size(); v++){
+        const VPU* vpu = vpus[v];
+        const SNAPSHOT_VPU& e = entries[v];
+        put(e.vpt_offset, vpu->vpt, (UINT64) vpu->VPT_ENTRIES * sizeof(VPT_ENTRY));
+        put(e.ct_offset, vpu->ct, (UINT64) vpu->CT_ENTRIES * sizeof(CT_ENTRY));
+        put(e.ct_owner_offset, vpu->ct_owner, (UINT64) vpu->CT_ENTRIES * sizeof(UINT32));
+        put(e.slab_offset, vpu->slabs, (UINT64) vpu->SLABS * vpu->SLAB_BYTES);
+        if(vpu->viccache.capacity){
+            put(e.vc_node_offset, vpu->viccache.nodes, (UINT64) vpu->viccache.capacity * sizeof(VIC_CACHE::NODE));
+            put(e.vc_index_offset, vpu->viccache.index, (UINT64) (vpu->viccache.index_mask + 1) * sizeof(UINT32));
+        }
+        if(vpu->fcm){ put(e.fcm_offset, vpu->fcm, (UINT64) vpu->VPT_ENTRIES * sizeof(UINT64)); }
+        if(vpu->vpt_tags){
+            put(e.tags_offset, vpu->vpt_tags, (UINT64) vpu->VPT_ENTRIES * sizeof(UINT64));
+            put(e.repl_offset, vpu->vpt_repl, (UINT64) vpu->VPT_SETS * sizeof(UINT64));
+        }
+        put(e.wide_offset, vpu->arena.base, e.wide_used);
+    }
+    put(header.inst_offset, insts.data(), insts.size() * sizeof(SNAPSHOT_INST));
+    ok = (fclose(f) == 0) && ok;
+    if(!ok || rename(tmp.c_str(), path.c_str()) != 0){
+        unlink(tmp.c_str());
+        return "Cannot write snapshot file " + path;
+    }
+    return "";
+}
+
+/* ===================================================================== */
+/* Reader                                                                */
+/* ===================================================================== */
+// A snapshot mapped copy-on-write, so the VPUs it is loaded into can keep training in place
+// without changing the file. Stays mapped for the rest of the run.
+class SNAPSHOT {
+public:
+  int fd;
+  UINT8* base;
+  const SNAPSHOT_HEADER* header;
+  const SNAPSHOT_VPU* vpus;
+  const SNAPSHOT_INST* insts;
+
+  SNAPSHOT() : fd(-1), base(NULL), header(NULL), vpus(NULL), insts(NULL) {}
+
+  bool loaded() const { return base != NULL; }
+
+  // Whether bytes at offset lie inside the file, offset on a page boundary when aligned is set.
+  // Checked before anything is pointed at or mapped over a section, so a damaged or hand edited
+  // file fails to load instead of reading past the mapping.
+  bool section_ok(UINT64 offset, UINT64 bytes, bool aligned = true) const {
+    if(aligned && (offset & (SNAPSHOT_ALIGN - 1))){ return false; }
+    return offset <= header->file_bytes && bytes <= header->file_bytes - offset;
+  }
+
+  // Map path and check its header. Returns an error message, empty on success.
+  std::string open(const std::string& path){
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0){ return "Cannot open snapshot file " + path; }
+    if((UINT64) st.st_size < sizeof(SNAPSHOT_HEADER)){ return path + ": not a snapshot"; }
+    base = (UINT8*) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(base == MAP_FAILED){
+        base = NULL;
+        return "Cannot map snapshot file " + path;
+    }
+    header = (const SNAPSHOT_HEADER*) base;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0){ return path + ": not a snapshot"; }
+    if(header->version != SNAPSHOT_VERSION){ return path + ": unsupported snapshot version"; }
+    if(header->vpt_entry_bytes != sizeof(VPT_ENTRY) || header->vc_node_bytes != sizeof(VIC_CACHE::NODE)
+       || header->stats_bytes != sizeof(VPU_STATS) || header->inst_bytes != sizeof(SNAPSHOT_INST)
+       || header->ct_entry_bytes != sizeof(CT_ENTRY)){
+        return path + ": snapshot written by another build";
+    }
+    if(header->file_bytes != (UINT64) st.st_size){ return path + ": truncated snapshot"; }
+    if(!section_ok(sizeof(SNAPSHOT_HEADER), (UINT64) header->vpus * sizeof(SNAPSHOT_VPU), false)
+       || header->inst_count > header->file_bytes / sizeof(SNAPSHOT_INST)
+       || !section_ok(header->inst_offset, header->inst_count * sizeof(SNAPSHOT_INST))){
+        return path + ": corrupt snapshot";
+    }
+    vpus = (const SNAPSHOT_VPU*) (base + sizeof(SNAPSHOT_HEADER));
+    insts = (const SNAPSHOT_INST*) (base + header->inst_offset);
+    return "";
+  }
+
+  // Point vpu, created without tables, at the tables of VPU number v. Returns an error message,
+  // empty on success.
+  std::string restore(VPU& vpu, UINT32 v){
+    if(v >= header->vpus){ return "The snapshot has fewer configurations than this run"; }
+    const SNAPSHOT_VPU& e = vpus[v];
+    if(config_string(e.config) != config_string(vpu.config)){
+        return "Configuration " + config_string(vpu.config) + " does not match the snapshot's " + config_string(e.config);
+    }
+    //Every section this configuration reads must be in the file before the VPU points at it
+    bool ok = section_ok(e.vpt_offset, (UINT64) vpu.VPT_ENTRIES * sizeof(VPT_ENTRY))
+              && section_ok(e.ct_offset, (UINT64) vpu.CT_ENTRIES * sizeof(CT_ENTRY))
+              && section_ok(e.ct_owner_offset, (UINT64) vpu.CT_ENTRIES * sizeof(UINT32))
+              && section_ok(e.slab_offset, (UINT64) vpu.SLABS * vpu.SLAB_BYTES)
+              && section_ok(e.wide_offset, e.wide_used);
+    if(vpu.viccache.capacity){
+        ok = ok && e.vc_size <= vpu.viccache.capacity
+             && section_ok(e.vc_node_offset, (UINT64) vpu.viccache.capacity * sizeof(VIC_CACHE::NODE))
+             && section_ok(e.vc_index_offset, (UINT64) (vpu.viccache.index_mask + 1) * sizeof(UINT32));
+    }
+    if(vpu.uses_fcm()){ ok = ok && e.fcm_offset && section_ok(e.fcm_offset, (UINT64) vpu.VPT_ENTRIES * sizeof(UINT64)); }
+    if(vpu.VPT_WAYS > 1){
+        ok = ok && e.tags_offset && section_ok(e.tags_offset, (UINT64) vpu.VPT_ENTRIES * sizeof(UINT64))
+             && section_ok(e.repl_offset, (UINT64) vpu.VPT_SETS * sizeof(UINT64));
+    }
+    if(!ok){ return "The snapshot's tables for " + config_string(vpu.config) + " lie outside the file"; }
+    vpu.vpt = (VPT_ENTRY*) (base + e.vpt_offset);
+    vpu.ct = (CT_ENTRY*) (base + e.ct_offset);
+    vpu.ct_owner = (UINT32*) (base + e.ct_owner_offset);
+    vpu.ct_history = e.ct_history;
+    vpu.slabs = base + e.slab_offset;
+    if(vpu.viccache.capacity){
+        vpu.viccache.nodes = (VIC_CACHE::NODE*) (base + e.vc_node_offset);
+        vpu.viccache.index = (UINT32*) (base + e.vc_index_offset);
+        vpu.viccache.size = e.vc_size;
+        vpu.viccache.mru = e.vc_mru;
+        vpu.viccache.lru = e.vc_lru;
+        vpu.viccache.free_head = e.vc_free_head;
+    }
+    if(vpu.uses_fcm()){ vpu.fcm = (UINT64*) (base + e.fcm_offset); }
+    if(vpu.VPT_WAYS > 1){
+        vpu.vpt_tags = (UINT64*) (base + e.tags_offset);
+        vpu.vpt_repl = (UINT64*) (base + e.repl_offset);
+        vpu.repl_random = e.repl_random;
+    }
+    //The float value blocks go at the start of the VPU's own arena, so it can keep growing
+    if(e.wide_used){
+        if(e.wide_used > vpu.arena.reserved){ return "The snapshot's float values do not fit the value history arena"; }
+        void* wide = mmap(vpu.arena.base, snapshot_align(e.wide_used), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, e.wide_offset);
+        if(wide == MAP_FAILED){ return "Cannot map the snapshot's float values"; }
+        vpu.arena.used = e.wide_used;
+    }
+    return "";
+  }
+
+  // The record of the instruction at ins_ptr, NULL if the snapshot has none
+  const SNAPSHOT_INST* find(ADDRINT ins_ptr) const {
+    const SNAPSHOT_INST* lo = insts;
+    const SNAPSHOT_INST* hi = insts + header->inst_count;
+    while(lo < hi){
+        const SNAPSHOT_INST* mid = lo + (hi - lo) / 2;
+        if(mid->ins_ptr < ins_ptr){ lo = mid + 1; } else { hi = mid; }
+    }
+    return (lo != insts + header->inst_count && lo->ins_ptr == ins_ptr) ? lo : NULL;
+  }
+};
+
+#endif
@@ -0,0 +1,367 @@
+// Value trace: the stream of (IP, INST_CAT, RT, value) that value_predict sees, written by the
+// pintool's -trace_out knob and read back by the replay simulator (replay.cpp).
+//
+// File layout:
+//   TRACE_HEADER
+//   blocks, each a TRACE_BLOCK followed by packed_bytes of LZ compressed records
+//   index, one TRACE_INDEX_ENTRY per block
+//   one TRACE_INST per instruction writing a register, the registers the dataflow timing model
+//   follows for it
+//   TRACE_FOOTER
+// Records never span blocks and the IP delta restarts from 0 in every block, so any block can be
+// found through the index and decoded on its own.
+//
+// Record encoding, before compression:
+//   1 byte   INST_CAT in the low 4 bits, RT in the next 3, and TRACE_FIRST in the top bit on the
+//            first record of each executed instruction (one that loads, writes a register and
+//            stores has up to three records), so the replay counts instructions as the pintool does
+//   1 byte   floats only: the register width in bytes, as the pintool compared the value over
+//   varint   zigzag encoded delta from the previous IP in the block
+//   n bytes  the value, n = trace_value_bytes(RT): 1/2/4/8 for ints, the width byte for floats
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <fstream>
+#include <vector>
+#include "vpu.h"
+
+#define TRACE_MAGIC "VPUTRACE"
+#define TRACE_VERSION 4
+#define TRACE_BLOCK_BYTES (1 << 20)  // raw bytes per block before compression
+#define TRACE_MAX_RECORD_BYTES (2 + 10 + MAX_BYTES_PER_PIN_REG)
+#define TRACE_FIRST 0x80             // header bit of an instruction's first record
+
+class TRACE_HEADER {
+public:
+  char magic[8];
+  UINT32 version;
+  UINT32 value_bytes;  // MAX_BYTES_PER_PIN_REG of the writer
+};
+
+class TRACE_BLOCK {
+public:
+  UINT32 raw_bytes;    // size once decompressed
+  UINT32 packed_bytes; // size of the compressed data following this header
+  UINT64 records;
+};
+
+class TRACE_INDEX_ENTRY {
+public:
+  UINT64 offset;       // file offset of the TRACE_BLOCK
+  UINT64 first_record; // number of records in all earlier blocks
+};
+
+// The DATAFLOW registers of one static instruction, as the pintool numbered them
+class TRACE_INST {
+public:
+  UINT64 ip;
+  UINT16 srcs[DF_MAX_SRCS];
+  UINT16 num_srcs;
+  UINT16 dst;
+  UINT32 pad;
+};
+
+class TRACE_FOOTER {
+public:
+  UINT64 index_offset;
+  UINT64 blocks;
+  UINT64 records;
+  UINT64 inst_offset;   // file offset of the TRACE_INST records
+  UINT64 insts;
+  UINT32 limit_reached; // did the capture stop at inst_limit rather than at fini?
+  UINT32 pad;
+  char magic[8];
+};
+
+// Bytes of an int value in a record, floats have their width in the record
+inline UINT32 trace_value_bytes(RT type){
+    switch(type){
+        case i8reg: return 1;
+        case i16reg: return 2;
+        case i32reg: return 4;
+        default: return 8;
+    }
+}
+
+/* ===================================================================== */
+/* Block compression                                                     */
+/* ===================================================================== */
+// A small LZ77 coder in the style of LZ4. Each sequence is a token byte (literal count in the
+// high nibble, match length - 4 in the low nibble, 15 meaning more length bytes follow), the
+// literals, then a 16 bit little endian match offset. The last sequence has literals only.
+#define TRACE_LZ_MIN_MATCH 4
+#define TRACE_LZ_HASH_BITS 14
+#define TRACE_LZ_BOUND(n) ((n) + (n) / 255 + 16)  // worst case compressed size
+
+inline UINT32 trace_lz_read32(const UINT8* p){
+    UINT32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline UINT8* trace_lz_length(UINT8* op, UINT32 len){
+    for(; len >= 255; len -= 255){ *op++ = 255; }
+    *op++ = (UINT8) len;
+    return op;
+}
+
+inline UINT8* trace_lz_sequence(UINT8* op, const UINT8* lit, UINT32 lit_len, UINT32 offset, UINT32 match_len){
+    UINT32 ml = match_len ? match_len - TRACE_LZ_MIN_MATCH : 0;
+    *op++ = (UINT8) (((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if(lit_len >= 15){ op = trace_lz_length(op, lit_len - 15); }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if(match_len){
+        *op++ = (UINT8) (offset & 0xFF);
+        *op++ = (UINT8) (offset >> 8);
+        if(ml >= 15){ op = trace_lz_length(op, ml - 15); }
+    }
+    return op;
+}
+
+// Compress n bytes of src into dst (at least TRACE_LZ_BOUND(n) long), returns the compressed size
+inline UINT32 trace_lz_compress(const UINT8* src, UINT32 n, UINT8* dst){
+    static UINT32 table[1 << TRACE_LZ_HASH_BITS];  // last position of each hashed 4 byte sequence
+    memset(table, 0xFF, sizeof(table));
+    UINT8* op = dst;
+    UINT32 anchor = 0;
+    UINT32 i = 0;
+    while(i + TRACE_LZ_MIN_MATCH <= n){
+        UINT32 seq = trace_lz_read32(src + i);
+        UINT32 h = (seq * 2654435761U) >> (32 - TRACE_LZ_HASH_BITS);
+        UINT32 cand = table[h];
+        table[h] = i;
+        if(cand == 0xFFFFFFFF || i - cand > 0xFFFF || trace_lz_read32(src + cand) != seq){
+            i++;
+            continue;
+        }
+        UINT32 len = TRACE_LZ_MIN_MATCH;
+        while(i + len < n && src[cand + len] == src[i + len]){ len++; }
+        op = trace_lz_sequence(op, src + anchor, i - anchor, i - cand, len);
+        i += len;
+        anchor = i;
+    }
+    op = trace_lz_sequence(op, src + anchor, n - anchor, 0, 0);
+    return op - dst;
+}
+
+// Decompress n bytes of src into exactly dst_len bytes of dst. Returns false on corrupt input.
+inline bool trace_lz_decompress(const UINT8* src, UINT32 n, UINT8* dst, UINT32 dst_len){
+    const UINT8* ip = src;
+    const UINT8* end = src + n;
+    UINT8* op = dst;
+    UINT8* op_end = dst + dst_len;
+    while(ip < end){
+        UINT8 token = *ip++;
+        UINT32 lit = token >> 4;
+        if(lit == 15){
+            UINT8 b;
+            do {
+                if(ip >= end){ return false; }
+                b = *ip++;
+                lit += b;
+            } while(b == 255);
+        }
+        if(lit > (UINT32) (end - ip) || lit > (UINT32) (op_end - op)){ return false; }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if(ip >= end){ break; } //last sequence
+        if(end - ip < 2){ return false; }
+        UINT32 offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        UINT32 len = token & 15;
+        if(len == 15){
+            UINT8 b;
+            do {
+                if(ip >= end){ return false; }
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+        len += TRACE_LZ_MIN_MATCH;
+        if(offset == 0 || offset > (UINT32) (op - dst) || len > (UINT32) (op_end - op)){ return false; }
+        const UINT8* match = op - offset;
+        while(len--){ *op++ = *match++; }  //byte at a time, matches may overlap
+    }
+    return op == op_end;
+}
+
+/* ===================================================================== */
+/* Writer                                                                */
+/* ===================================================================== */
+class TRACE_WRITER {
+public:
+  std::ofstream file;
+  UINT8* raw;       // records of the current block
+  UINT8* raw_end;   // next free byte of raw
+  UINT8* packed;    // compression buffer
+  ADDRINT last_ip;
+  UINT64 block_records;
+  UINT64 records;
+  std::vector<TRACE_INDEX_ENTRY> index;
+  std::vector<TRACE_INST> insts;  // written by close
+  bool closed;
+
+  TRACE_WRITER() : raw(NULL), raw_end(NULL), packed(NULL), last_ip(0), block_records(0), records(0), closed(true) {}
+
+  bool open(const std::string& path){
+    file.open(path.c_str(), std::ios_base::binary | std::ios_base::trunc);
+    if(!file){ return false; }
+    raw = new UINT8[TRACE_BLOCK_BYTES + TRACE_MAX_RECORD_BYTES];
+    raw_end = raw;
+    packed = new UINT8[TRACE_LZ_BOUND(TRACE_BLOCK_BYTES + TRACE_MAX_RECORD_BYTES)];
+    TRACE_HEADER header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.value_bytes = MAX_BYTES_PER_PIN_REG;
+    file.write((const char*) &header, sizeof(header));
+    closed = false;
+    return true;
+  }
+
+  void append(ADDRINT ip, INST_CAT flag, RT type, const regval& v, bool first){
+    UINT8* p = raw_end;
+    *p++ = (UINT8) (flag | (type << 4) | (first ? TRACE_FIRST : 0));
+    UINT32 n = IS_FLOAT(type) ? v.bytes : trace_value_bytes(type);
+    if(IS_FLOAT(type)){ *p++ = (UINT8) n; }
+    INT64 delta = (INT64) (ip - last_ip);
+    UINT64 zigzag = ((UINT64) delta << 1) ^ (UINT64) (delta >> 63);
+    while(zigzag >= 0x80){
+      *p++ = (UINT8) (zigzag | 0x80);
+      zigzag >>= 7;
+    }
+    *p++ = (UINT8) zigzag;
+    memcpy(p, v.float_store, n);  //ints are little endian, so the low n bytes of value
+    raw_end = p + n;
+    last_ip = ip;
+    block_records++;
+    if(raw_end - raw >= TRACE_BLOCK_BYTES){ flush_block(); }
+  }
+
+  void flush_block(){
+    if(!block_records){ return; }
+    TRACE_INDEX_ENTRY entry;
+    entry.offset = file.tellp();
+    entry.first_record = records;
+    index.push_back(entry);
+    TRACE_BLOCK block;
+    block.raw_bytes = raw_end - raw;
+    block.packed_bytes = trace_lz_compress(raw, block.raw_bytes, packed);
+    block.records = block_records;
+    file.write((const char*) &block, sizeof(block));
+    file.write((const char*) packed, block.packed_bytes);
+    records += block_records;
+    block_records = 0;
+    raw_end = raw;
+    last_ip = 0;
+  }
+
+  // Record the dataflow registers of the instruction at ip, before close
+  void add_inst(ADDRINT ip, const UINT16* srcs, UINT32 num_srcs, UINT16 dst){
+    TRACE_INST inst;
+    memset(&inst, 0, sizeof(inst));
+    inst.ip = ip;
+    memcpy(inst.srcs, srcs, num_srcs * sizeof(UINT16));
+    inst.num_srcs = num_srcs;
+    inst.dst = dst;
+    insts.push_back(inst);
+  }
+
+  // Write the last block, the index, the instructions and the footer. Safe to call more than once.
+  void close(bool limit_reached){
+    if(closed){ return; }
+    flush_block();
+    TRACE_FOOTER footer;
+    footer.index_offset = file.tellp();
+    footer.blocks = index.size();
+    footer.records = records;
+    footer.limit_reached = limit_reached;
+    footer.pad = 0;
+    memcpy(footer.magic, TRACE_MAGIC, sizeof(footer.magic));
+    if(!index.empty()){ file.write((const char*) &index[0], index.size() * sizeof(TRACE_INDEX_ENTRY)); }
+    footer.inst_offset = file.tellp();
+    footer.insts = insts.size();
+    if(!insts.empty()){ file.write((const char*) &insts[0], insts.size() * sizeof(TRACE_INST)); }
+    file.write((const char*) &footer, sizeof(footer));
+    file.close();
+    closed = true;
+  }
+};
+
+/* ===================================================================== */
+/* Reader                                                                */
+/* ===================================================================== */
+// Reads a trace held in memory (the replay simulator maps the whole file)
+class TRACE_READER {
+public:
+  const UINT8* data;
+  UINT64 size;
+  const TRACE_HEADER* header;
+  const TRACE_FOOTER* footer;
+  const TRACE_INDEX_ENTRY* index;
+  const TRACE_INST* insts;
+  std::vector<UINT8> raw;  // current decompressed block
+
+  TRACE_READER() : data(NULL), size(0), header(NULL), footer(NULL), index(NULL), insts(NULL) {}
+
+  // Check the header, footer and index of a trace. Returns an error message, empty on success.
+  std::string attach(const UINT8* file_data, UINT64 file_size){
+    data = file_data;
+    size = file_size;
+    if(size < sizeof(TRACE_HEADER) + sizeof(TRACE_FOOTER)){ return "file too small"; }
+    header = (const TRACE_HEADER*) data;
+    footer = (const TRACE_FOOTER*) (data + size - sizeof(TRACE_FOOTER));
+    if(memcmp(header->magic, TRACE_MAGIC, 8) || memcmp(footer->magic, TRACE_MAGIC, 8)){ return "not a value trace, or the capture did not finish"; }
+    if(header->version != TRACE_VERSION){ return "unsupported trace version"; }
+    if(header->value_bytes != MAX_BYTES_PER_PIN_REG){ return "trace was captured with a different register size"; }
+    if(footer->blocks > size / sizeof(TRACE_INDEX_ENTRY) || footer->insts > size / sizeof(TRACE_INST)){ return "corrupt index"; }
+    if(footer->index_offset + footer->blocks * sizeof(TRACE_INDEX_ENTRY) != footer->inst_offset
+       || footer->inst_offset + footer->insts * sizeof(TRACE_INST) + sizeof(TRACE_FOOTER) != size){ return "corrupt index"; }
+    index = (const TRACE_INDEX_ENTRY*) (data + footer->index_offset);
+    insts = (const TRACE_INST*) (data + footer->inst_offset);
+    return "";
+  }
+
+  // Decode every record of block b, calling f(ip, flag, type, value, first). Returns false on corrupt data.
+  template <typename F>
+  bool for_each_record(UINT64 b, F f){
+    const TRACE_BLOCK* block = (const TRACE_BLOCK*) (data + index[b].offset);
+    const UINT8* packed = (const UINT8*) (block + 1);
+    if(packed + block->packed_bytes > data + footer->index_offset){ return false; }
+    raw.resize(block->raw_bytes + TRACE_MAX_RECORD_BYTES);
+    if(!trace_lz_decompress(packed, block->packed_bytes, &raw[0], block->raw_bytes)){ return false; }
+    const UINT8* p = &raw[0];
+    const UINT8* end = p + block->raw_bytes;
+    ADDRINT ip = 0;
+    regval v;
+    memset(v.float_store, 0, sizeof(v.float_store));
+    for(UINT64 r = 0; r < block->records; r++){
+      if(p >= end){ return false; }
+      INST_CAT flag = (INST_CAT) (*p & 0xF);
+      bool first = *p & TRACE_FIRST;
+      RT type = (RT) ((*p++ & ~TRACE_FIRST) >> 4);
+      UINT32 n = trace_value_bytes(type);
+      if(IS_FLOAT(type)){ n = *p++; }
+      if(!n || n > MAX_BYTES_PER_PIN_REG){ return false; }
+      UINT64 zigzag = 0;
+      for(UINT32 shift = 0; ; shift += 7){
+        UINT8 b = *p++;
+        zigzag |= (UINT64) (b & 0x7F) << shift;
+        if(!(b & 0x80)){ break; }
+      }
+      ip += (ADDRINT) ((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+      v.value = 0;
+      memcpy(v.float_store, p, n);
+      memset(v.float_store + n, 0, MAX_BYTES_PER_PIN_REG - n);
+      p += n;
+      v.real_type = type;
+      v.bytes = IS_FLOAT(type) ? n : 8;
+      if(flag >= CATEGORIES || p > end){ return false; }
+      f(ip, flag, type, v, first);
+    }
+    return p == end;
+  }
+};
+
+#endif // TRACE_H
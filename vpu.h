@@ -0,0 +1,1717 @@
+// Value Prediction Unit core: the VPT, CT and victim cache models and the statistics they keep.
+// This file does not depend on Pin. The pintool (main.cpp) feeds it values captured from the
+// target program, and the replay simulator (replay.cpp) feeds it values read back from a trace.
+#ifndef VPU_H
+#define VPU_H
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <new>
+#include <sys/mman.h>
+#include <emmintrin.h>
+#ifdef PROFILE
+#include <x86intrin.h>
+#endif
+
+//turn on printf debug messages
+//#define PRINTF
+
+//turn on rdtsc timing of the per value work, reported as a TOOL PROFILE block
+//#define PROFILE
+
+// Pin's integer types, for builds that do not include pin.H first
+#ifndef VPU_HAVE_PIN_TYPES
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t INT32;
+typedef int64_t INT64;
+typedef uint64_t ADDRINT;
+#endif
+
+// Largest register value in bytes (Pin's PIN_REGISTER size)
+#ifndef MAX_BYTES_PER_PIN_REG
+#define MAX_BYTES_PER_PIN_REG 64
+#endif
+
+// Create function for x^y
+inline UINT32 POW(UINT32 x, UINT32 y) {
+  UINT32 x_y = 1;
+  for (UINT32 i = 0; i < y; i++) { x_y *= x ; }
+  return x_y;
+};
+
+// Category for instruction
+enum INST_CAT {
+  UNKNOWN,
+  I_PURE_LOAD,
+  I_LOAD_ARITH,
+  I_PURE_ARITH,
+  I_ARITH_1OP,
+  I_ARITH_2OP,
+  I_REG_MOV,
+  F_PURE_LOAD,
+  F_LOAD_ARITH,
+  F_PURE_ARITH,
+  F_REG_MOVE,
+  M_LOAD_ADDR,    // effective address of a memory read, -mem_values
+  M_STORE_VALUE,  // value written to memory, -mem_values
+};
+
+static const std::string INST_CAT_s[] = {
+  "UNKNOWN",
+  "I_PURE_LOAD",
+  "I_LOAD_ARITH",
+  "I_PURE_ARITH",
+  "I_ARITH_1OP",
+  "I_ARITH_2OP",
+  "I_REG_MOV",
+  "F_PURE_LOAD",
+  "F_LOAD_ARITH",
+  "F_PURE_ARITH",
+  "F_REG_MOVE",
+  "M_LOAD_ADDR",
+  "M_STORE_VALUE"
+};
+
+const UINT8 CATEGORIES = sizeof(INST_CAT_s)/sizeof(INST_CAT_s[0]);
+
+// Value streams a VPU can predict: the registers instructions write, or their memory operands
+enum VP_STREAM {
+  STREAM_REG,   // register outputs, the categories up to F_REG_MOVE
+  STREAM_LOAD,  // load addresses, M_LOAD_ADDR
+  STREAM_STORE  // store values, M_STORE_VALUE
+};
+
+static const std::string VP_STREAM_s[] = {"reg", "load", "store"};
+const UINT32 VP_STREAMS = sizeof(VP_STREAM_s)/sizeof(VP_STREAM_s[0]);
+
+// Stream called name, returns false if there is none
+inline bool parse_stream(const std::string& name, UINT32& stream){
+    for(UINT32 i = 0; i < VP_STREAMS; i++){
+        if(name == VP_STREAM_s[i]){
+            stream = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Stream the values of category flag belong to
+inline UINT32 stream_of(UINT32 flag){
+    if(flag == M_LOAD_ADDR){ return STREAM_LOAD; }
+    return flag == M_STORE_VALUE ? STREAM_STORE : STREAM_REG;
+}
+
+// Phases of the per value work timed with PROFILE
+enum PROFILE_PHASE {
+  PROF_CAPTURE,    // building the regval from the register
+  PROF_LOCALITY,   // value locality check
+  PROF_TRACE,      // appending to -trace_out
+  PROF_VPT_LOOKUP, // VPT tag check, victim cache and value history match
+  PROF_CT_UPDATE,  // CT counter and prediction statistics
+  PROF_HISTORY,    // value history update
+  PROF_TIMING,     // dataflow timing model
+  PROF_PHASES
+};
+
+static const std::string PROFILE_PHASE_s[] = {
+  "CAPTURE",
+  "LOCALITY",
+  "TRACE",
+  "VPT_LOOKUP",
+  "CT_UPDATE",
+  "HISTORY",
+  "TIMING"
+};
+
+// PROFILE_START(t) reads the time stamp counter into t, PROFILE_LAP(t, cycles, phase) adds the
+// cycles since then to cycles[phase] and restarts t. Both are empty unless PROFILE is defined.
+#ifdef PROFILE
+#define PROFILE_START(t) UINT64 t = __rdtsc()
+#define PROFILE_LAP(t, cycles, phase) do { UINT64 now_ = __rdtsc(); (cycles)[phase] += now_ - t; t = now_; } while(0)
+#else
+#define PROFILE_START(t)
+#define PROFILE_LAP(t, cycles, phase)
+#endif
+
+enum RT{freg=1, i8reg=2, i16reg=3, i32reg=4, i64reg=5}; 
+#define IS_FLOAT(type) ((type == freg))
+static const std::string rt_name[] = {"", "Float Reg", "8 Bit Int", "16 Bit Int", "32 Bit Int", "64 Bit Int"};
+
+// Masks off the bits of an int register that are not part of the value, indexed by RT
+const UINT64 INT_MASK[] = {0, 0, 0xFF, 0xFFFF, 0xFFFFFFFF, 0xFFFFFFFFFFFFFFFF};
+
+static const UINT8 ZEROBUF[] = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+
+class regval{ 
+public:
+    //enum RVT{FLOAT, INT} tag; //float type or int type? 
+    RT real_type; //type?
+    UINT8 bytes;  //width of a float value, the rest of float_store is zero. 8 for ints
+    union{
+        UINT8 float_store[MAX_BYTES_PER_PIN_REG]; // to store any float (some floats can be loooooooomg)
+        UINT64 value; //to store any int type 
+    };
+    regval(){}
+    regval(void* p_to_val, RT type){ 
+        if(IS_FLOAT(type)){
+            memcpy(float_store, p_to_val, MAX_BYTES_PER_PIN_REG);
+            bytes = MAX_BYTES_PER_PIN_REG;
+        }else{
+            value = *((UINT64*) p_to_val);
+            bytes = 8;
+        }
+        real_type = type;
+    } 
+    // Int register value, the bits above the register's width are ignored
+    regval(UINT64 v, RT type) : real_type(type), bytes(8) { value = v; }
+
+    // Take a float register of bytes bytes, zeroing the rest so the whole store compares equal
+    void set_float(const void* p_to_val, UINT32 bytes){
+        real_type = freg;
+        this->bytes = bytes;
+        memcpy(float_store, p_to_val, bytes);
+        memset(float_store + bytes, 0, MAX_BYTES_PER_PIN_REG - bytes);
+    }
+
+    // Compare with a value kept compactly, last for ints or BYTES bytes at last_wide for floats,
+    // for a register type known at compile time
+    template<RT TYPE, UINT32 BYTES>
+    bool same(UINT64 last, const UINT8* last_wide) const {
+        if(IS_FLOAT(TYPE)){ return memcmp(float_store, last_wide, BYTES) == 0; }
+        return ((value ^ last) & INT_MASK[TYPE]) == 0;
+    }
+    bool operator==(const regval& other) const {
+        assert(real_type == other.real_type);
+        switch(real_type){
+            case freg:
+                return (memcmp(float_store, other.float_store, MAX_BYTES_PER_PIN_REG) == 0);
+                break;
+            case i64reg:
+                return (value == other.value);
+                break;
+            case i32reg:
+                return ((value&0xFFFFFFFF) == (other.value&0xFFFFFFFF));
+                break;
+            case i16reg:
+                return ((value&0xFFFF) == (other.value&0xFFFF));
+                break;
+            case i8reg:
+                return ((value&0xFF) == (other.value&0xFF));
+                break;
+            default:
+                assert(false);
+        }
+    }
+
+}; 
+
+
+// cout << a << endl
+inline std::ostream& operator<<(std::ostream &strm, const regval &a) {
+    switch(a.real_type){
+        case freg:
+            strm << "FLOAT(";
+            //the register's own bytes, most significant first
+            for(int i = (int) a.bytes - 1; i >= 0; i--){
+                strm <<std::setfill('0') << std::setw(2) << std::hex << (UINT32) (a.float_store[i]);
+            }
+            strm << std::setfill(' ') << std::dec << ")";
+            return strm;
+            break;
+        case i64reg:
+            return strm << "INT(" << a.value << ")"; 
+            break;
+        case i32reg:
+            return strm << "INT(" << (a.value&0xFFFFFFFF) << ")"; 
+            break;
+        case i16reg:
+            return strm << "INT(" << (a.value&0xFFFF) << ")"; 
+            break;
+        case i8reg:
+            return strm << "INT(" << (a.value&0xFF) << ")"; 
+            break;
+        default:
+            assert(false);
+    }
+}
+
+/* ===================================================================== */
+/* Value Prediction Unit                                                 */
+/* ===================================================================== */
+#define CACHE_LINE_BYTES 64
+
+// Allocate a cache line aligned array of n default constructed objects.
+// The tables live for the whole run, so the raw allocation is never freed.
+template <typename T>
+inline T* new_aligned_table(UINT32 n){
+    char* raw = (char*) malloc(n * sizeof(T) + CACHE_LINE_BYTES);
+    T* table = (T*) (((ADDRINT) raw + CACHE_LINE_BYTES - 1) & ~((ADDRINT) CACHE_LINE_BYTES - 1));
+    for(UINT32 i = 0; i < n; i++){ new (&table[i]) T(); }
+    return table;
+}
+
+#define MAX_HIST_DEPTH 16
+// Returns a bitmask with bit i set if words[i] == key, for the first n (at most 16) of words.
+// words is 16 byte aligned and rounded up to an even number of words, two are compared per instruction.
+inline UINT32 match_words(const UINT64* words, UINT32 n, UINT64 key){
+    UINT32 hits = 0;
+    const __m128i* w = (const __m128i*) words;
+    __m128i want = _mm_set1_epi64x(key);
+    for(UINT32 i = 0; i < n; i += 2){
+      __m128i eq = _mm_cmpeq_epi32(_mm_load_si128(w + i / 2), want);
+      eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+      hits |= _mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+    }
+    return hits & ((1 << n) - 1);
+}
+
+// Value histories are kept in slabs sized by what they store, instead of one
+// MAX_BYTES_PER_PIN_REG slot per value:
+//  - a VH_HEADER, locating the entry's float values, if it has any
+//  - depth 8 byte slots (rounded up to an even number), holding int values or, with fingerprints,
+//    the 64 bit fingerprints of float values. They are packed so two fit in one SIMD register.
+//  - with fingerprints, a 32 bit check per slot, used to count fingerprint false matches
+// Float values without fingerprints go to a block of depth slots of the register's true width
+// (8 bytes for MMX, 16 for XMM, 32 for YMM, 64 for ZMM) in the VPU's WIDE_ARENA, taken when the slab first
+// holds a float value. The header lives in the slab, so the block moves with the slab between the
+// VPT and the victim cache. Slabs and blocks are found by index and offset, never by pointer, so
+// the tables can be saved and mapped back in as they are (see snapshot.h).
+class VH_HEADER {
+public:
+  UINT64 wide;        // offset of the float values in the WIDE_ARENA
+  UINT32 wide_bytes;  // slot width of the float values, 0 until the slab holds one
+  UINT32 pad;         // keeps the slots 16 byte aligned
+};
+
+inline UINT32 vh_key_bytes(UINT32 depth){ return ((depth + 1) & ~1) * 8; }
+inline UINT32 vh_slab_bytes(UINT32 depth, bool fingerprint){
+    return sizeof(VH_HEADER) + vh_key_bytes(depth) + (fingerprint ? (depth * 4 + 15) & ~15 : 0);
+}
+
+// 64 bit fingerprint of the first bytes bytes of a float value, and an independent 32 bit check
+inline UINT64 value_fingerprint(const regval& v, UINT32 bytes, UINT32& check){
+    UINT64 h = 0x9E3779B97F4A7C15ULL;
+    UINT64 c = 0xC2B2AE3D27D4EB4FULL;
+    for(UINT32 i = 0; i < bytes; i += 8){
+        UINT64 w;
+        memcpy(&w, v.float_store + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+        c = (c ^ w) * 0x9E3779B97F4A7C15ULL;
+        c ^= c >> 29;
+    }
+    check = (UINT32) (c >> 32);
+    return h;
+}
+
+#define WIDE_ARENA_FULL (~0ULL)  // WIDE_ARENA::alloc found no room
+
+// Bump allocator for float value blocks. The address range is reserved up front without
+// committing memory, pages are only backed once blocks are written to them.
+class WIDE_ARENA {
+public:
+  UINT8* base;
+  UINT64 reserved;
+  volatile UINT64 used;
+
+  WIDE_ARENA() : base(NULL), reserved(0), used(0) {}
+
+  // Returns false if the range cannot be reserved, base is then NULL
+  bool init(UINT64 bytes){
+    reserved = (bytes + 4095) & ~4095ULL;
+    used = 0;
+    if(!reserved){ return true; }
+    base = (UINT8*) mmap(NULL, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED){
+        base = NULL;
+        return false;
+    }
+    return true;
+  }
+
+  // Offset of a new 16 byte aligned block, WIDE_ARENA_FULL if there is no room left
+  UINT64 alloc(UINT64 bytes){
+    UINT64 offset = __sync_fetch_and_add(&used, (bytes + 15) & ~15ULL);
+    if(!base || offset + bytes > reserved){ return WIDE_ARENA_FULL; }
+    return offset;
+  }
+};
+
+// One value history slab, seen through its address
+class VH_SLAB {
+public:
+  UINT8* values;
+  VH_SLAB(UINT8* p) : values(p) {}
+
+  VH_HEADER& header() const { return *(VH_HEADER*) values; }
+  UINT64* keys() const { return (UINT64*) (values + sizeof(VH_HEADER)); }
+  UINT32* checks(UINT32 depth) const { return (UINT32*) (values + sizeof(VH_HEADER) + vh_key_bytes(depth)); }
+
+  // Returns a bitmask with bit s set if history slot s (of the first count) holds key
+  UINT32 match_key(UINT64 key, UINT32 count) const {
+    return match_words(keys(), count, key);
+  }
+
+  // Returns a bitmask with bit s set if history slot s (of the first count) holds the float value v
+  UINT32 match_wide(const regval& v, UINT32 count, const WIDE_ARENA& arena) const {
+    const VH_HEADER& h = header();
+    if(!count || h.wide_bytes < v.bytes){ return 0; } //the slots hold another instruction's values
+    UINT32 hits = 0;
+    UINT32 chunks = v.bytes / 16;
+    for(UINT32 s = 0; s < count; s++){
+      const UINT8* slot = arena.base + h.wide + s * h.wide_bytes;
+      // compare the slot 16 bytes at a time
+      __m128i eq = _mm_set1_epi8(-1);
+      for(UINT32 c = 0; c < chunks; c++){
+        __m128i val = _mm_loadu_si128((const __m128i*) (v.float_store + c * 16));
+        eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) slot + c), val));
+      }
+      if(_mm_movemask_epi8(eq) == 0xFFFF && memcmp(slot + chunks * 16, v.float_store + chunks * 16, v.bytes % 16) == 0){
+        hits |= 1 << s;
+      }
+    }
+    return hits;
+  }
+
+  // Store the float value v in slot s, taking a block of v's width if the slab has none as wide.
+  // The values of a block outgrown by a wider register are copied over, zero extended like a
+  // regval, and the old block is not reused. If the arena is full the value is not kept, which
+  // only costs predictions.
+  void store_wide(UINT32 s, const regval& v, UINT32 depth, WIDE_ARENA& arena){
+    VH_HEADER& h = header();
+    if(h.wide_bytes < v.bytes){
+      UINT64 wide = arena.alloc((UINT64) depth * v.bytes);
+      if(wide == WIDE_ARENA_FULL){ return; }
+      UINT8* block = arena.base + wide;
+      memset(block, 0, (UINT64) depth * v.bytes);
+      for(UINT32 i = 0; h.wide_bytes && i < depth; i++){
+        memcpy(block + i * v.bytes, arena.base + h.wide + i * h.wide_bytes, h.wide_bytes);
+      }
+      h.wide = wide;
+      h.wide_bytes = v.bytes;
+    }
+    memcpy(arena.base + h.wide + s * h.wide_bytes, v.float_store, v.bytes);
+  }
+
+  // Value stored in history slot s, for printing (fingerprints print as ints)
+  regval get(UINT32 s, RT type, bool fingerprint, const WIDE_ARENA& arena) const {
+    if(!IS_FLOAT(type) || fingerprint){ return regval(keys()[s], IS_FLOAT(type) ? i64reg : type); }
+    regval v;
+    v.set_float(arena.base + header().wide + s * header().wide_bytes, header().wide_bytes);
+    return v;
+  }
+};
+
+// Entry for Value Prediction Table
+// The value history lives in slab number slab of the VPU (see VH_HEADER). Slots are never moved,
+// instead order[] keeps the slot indices in LRU order (order[0] is the most recently used).
+class VPT_ENTRY {
+public:
+  ADDRINT tag; //What's the address? 
+  UINT32 slab; //value history slab
+  bool valid;  //has this slot been filled since the start of the run?
+  UINT8 count; //number of valid slots in the value history, slots 0 .. count-1 are used
+  UINT8 order[MAX_HIST_DEPTH]; //slot indices, most recently used first
+  //UINT8 prediction_history; // Used to determine whether we will use historic value (CT entry)
+  // Stride and context predictor state (see VP_TYPE), kept for int values only.
+  // Strides are 32 bit so the whole entry fits in one cache line, larger strides are never predicted.
+  UINT64 last;     //last value written
+  INT32 stride;    //stride added to last for the prediction
+  INT32 delta;     //last stride seen, 2delta only takes it as the stride once it repeats
+  UINT32 context;  //FCM: hash of the last FCMorder values
+  UINT8 chooser;   //hybrid: 2 bit counter, 2 or more trusts the FCM component over 2delta
+  VPT_ENTRY() : tag(0), slab(0), valid(false), count(0), last(0), stride(0), delta(0), context(0), chooser(1) {}
+
+  // Start the stride and context state of a new entry from its first value
+  void reset_state(UINT64 v){
+    last = v;
+    stride = 0;
+    delta = 0;
+    context = 0;
+    chooser = 1;
+  }
+
+  // Move the value in history slot s to the front of the LRU order
+  void touch(UINT32 s){
+    UINT32 pos = 0;
+    while(order[pos] != s){ pos++; }
+    for(; pos > 0; pos--){ order[pos] = order[pos - 1]; }
+    order[0] = s;
+  }
+
+  // Pick the slot for a new value at the front of the history, evicting the LRU value if the history is full
+  UINT32 insert_slot(UINT32 depth){
+    UINT32 s;
+    if(count < depth){
+      s = count;
+      order[count++] = s;
+    } else {
+      s = order[count - 1]; //Evict!!
+    }
+    touch(s);
+    return s;
+  }
+};
+
+// Entry for Classification Table
+class CT_ENTRY {
+public:
+  UINT8 counter; // saturating confidence counter, 0 .. CT_MAX
+  bool valid;    // has this instruction index been seen before?
+  UINT8 tag;     // CTindex=tagged: hash of the instruction in the tagged tables
+  CT_ENTRY() : counter(0), valid(false), tag(0) {}
+};
+
+// Allocate n zeroed value history slabs of slab_bytes in one block
+inline UINT8* new_vh_slabs(UINT32 n, UINT32 slab_bytes){
+    UINT8* slabs = new_aligned_table<UINT8>((UINT64) n * slab_bytes);
+    memset(slabs, 0, (UINT64) n * slab_bytes);
+    return slabs;
+}
+
+#define VC_NONE 0xFFFFFFFF
+
+// Fully associative victim cache with true LRU replacement.
+// Entries sit in a fixed array of nodes chained into an LRU list (prev/next are node indices),
+// and an open addressed hash index maps tag -> node, so lookup, promotion and eviction are O(1).
+// Every node owns a value history slab of the VPU for the whole run. Moving an entry in or out of
+// the cache swaps slab numbers with the VPT slot instead of allocating.
+class VIC_CACHE {
+public:
+  class NODE {
+  public:
+    VPT_ENTRY entry;
+    UINT32 prev, next; //neighbours in the LRU list (next also links the free list)
+  };
+  UINT32 capacity;
+  UINT32 size;
+  NODE* nodes;
+  UINT32 mru, lru;     //ends of the LRU list
+  UINT32 free_head;    //unused nodes
+  UINT32* index;       //hash index of node numbers, VC_NONE if empty
+  UINT32 index_mask;
+
+  VIC_CACHE() : capacity(0), size(0), nodes(NULL), mru(VC_NONE), lru(VC_NONE), free_head(VC_NONE), index(NULL), index_mask(0) {}
+
+  // Size the cache for entries nodes, without allocating the tables
+  void init(UINT32 entries){
+    capacity = entries;
+    //keep the index at most half full so probe sequences stay short
+    UINT32 index_size = 2;
+    while(index_size < 2 * capacity){ index_size *= 2; }
+    index_mask = index_size - 1;
+  }
+
+  // Allocate the tables, node i using slab first_slab + i
+  void allocate(UINT32 first_slab){
+    if(!capacity){ return; }
+    nodes = new_aligned_table<NODE>(capacity);
+    for(UINT32 i = 0; i < capacity; i++){ nodes[i].entry.slab = first_slab + i; }
+    index = new_aligned_table<UINT32>(index_mask + 1);
+    clear();
+  }
+
+  // Empty the cache, the nodes keep their slabs
+  void clear(){
+    if(!capacity){ return; }
+    for(UINT32 i = 0; i < capacity; i++){
+      nodes[i].next = (i + 1 < capacity) ? i + 1 : VC_NONE;
+    }
+    free_head = 0;
+    size = 0;
+    mru = lru = VC_NONE;
+    memset(index, 0xFF, (index_mask + 1) * sizeof(UINT32));
+  }
+
+  UINT32 home(ADDRINT tag) const {
+    return (UINT32) ((tag * 0x9E3779B97F4A7C15ULL) >> 32) & index_mask;
+  }
+
+  // Position of tag in the index, or VC_NONE
+  UINT32 find(ADDRINT tag) const {
+    for(UINT32 i = home(tag); index[i] != VC_NONE; i = (i + 1) & index_mask){
+      if(nodes[index[i]].entry.tag == tag){ return i; }
+    }
+    return VC_NONE;
+  }
+
+  // Remove the index entry at position i, shifting back later entries of the probe sequence
+  void unindex(UINT32 i){
+    UINT32 j = i;
+    index[i] = VC_NONE;
+    while(true){
+      j = (j + 1) & index_mask;
+      if(index[j] == VC_NONE){ return; }
+      UINT32 k = home(nodes[index[j]].entry.tag);
+      // leave it if its home is cyclically within (i, j]
+      if((i <= j) ? (i < k && k <= j) : (i < k || k <= j)){ continue; }
+      index[i] = index[j];
+      index[j] = VC_NONE;
+      i = j;
+    }
+  }
+
+  void unlink(UINT32 n){
+    if(nodes[n].prev != VC_NONE){ nodes[nodes[n].prev].next = nodes[n].next; } else { mru = nodes[n].next; }
+    if(nodes[n].next != VC_NONE){ nodes[nodes[n].next].prev = nodes[n].prev; } else { lru = nodes[n].prev; }
+  }
+
+  // Insert victim as the most recently used entry, evicting the lru if the cache is full.
+  // Returns the value history slab the victim's VPT slot should use from now on.
+  UINT32 insert(const VPT_ENTRY& victim){
+    if(!capacity){ return victim.slab; } //a victim cache of size 0 just drops the entry
+    UINT32 n;
+    if(size >= capacity){
+      n = lru;
+      unindex(find(nodes[n].entry.tag));
+      unlink(n);
+    } else {
+      n = free_head;
+      free_head = nodes[n].next;
+      size++;
+    }
+    UINT32 spare = nodes[n].entry.slab;
+    nodes[n].entry = victim;
+    nodes[n].prev = VC_NONE;
+    nodes[n].next = mru;
+    if(mru != VC_NONE){ nodes[mru].prev = n; } else { lru = n; }
+    mru = n;
+    UINT32 i = home(victim.tag);
+    while(index[i] != VC_NONE){ i = (i + 1) & index_mask; }
+    index[i] = n;
+    return spare;
+  }
+
+  // Bytes allocated for the nodes and the index (their slabs are counted by the VPU)
+  UINT64 memory_bytes() const {
+    if(!capacity){ return 0; }
+    return (UINT64) capacity * sizeof(NODE) + (UINT64) (index_mask + 1) * sizeof(UINT32);
+  }
+
+  // If tag is cached, move its entry into dst (handing dst's slab to the freed node) and return true
+  bool take(ADDRINT tag, VPT_ENTRY& dst){
+    if(!size){ return false; }
+    UINT32 i = find(tag);
+    if(i == VC_NONE){ return false; }
+    UINT32 n = index[i];
+    unindex(i);
+    unlink(n);
+    UINT32 spare = dst.slab;
+    dst = nodes[n].entry;
+    nodes[n].entry.slab = spare;
+    nodes[n].next = free_head;
+    free_head = n;
+    size--;
+    return true;
+  }
+};
+
+// How a VPT entry predicts the next value of its instruction.
+// Float values are always predicted from the value history, as with VP_LAST.
+enum VP_TYPE {
+  VP_LAST,    // one of the last HistDepth values
+  VP_STRIDE,  // last value plus the last stride
+  VP_2DELTA,  // last value plus a stride that has been seen twice in a row
+  VP_FCM,     // order k finite context method: the value that followed the last k values last time
+  VP_HYBRID   // 2delta or FCM, picked per entry by a 2 bit chooser
+};
+
+static const std::string VP_TYPE_s[] = {"last", "stride", "2delta", "fcm", "hybrid"};
+const UINT32 VP_TYPES = sizeof(VP_TYPE_s)/sizeof(VP_TYPE_s[0]);
+
+// Predictor type called name, returns false if there is none
+inline bool parse_pred_type(const std::string& name, UINT32& type){
+    for(UINT32 i = 0; i < VP_TYPES; i++){
+        if(name == VP_TYPE_s[i]){
+            type = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+#define MAX_FCM_ORDER 8
+
+// Replacement policy within a set of the VPT (VPTways > 1)
+enum VPT_REPL {
+  REPL_LRU,     // true LRU, a stack of way numbers per set
+  REPL_PLRU,    // tree pseudo LRU, VPTways - 1 bits per set
+  REPL_RANDOM   // any way, no state per set
+};
+
+static const std::string VPT_REPL_s[] = {"lru", "plru", "random"};
+const UINT32 VPT_REPLS = sizeof(VPT_REPL_s)/sizeof(VPT_REPL_s[0]);
+
+// Replacement policy called name, returns false if there is none
+inline bool parse_vpt_repl(const std::string& name, UINT32& repl){
+    for(UINT32 i = 0; i < VPT_REPLS; i++){
+        if(name == VPT_REPL_s[i]){
+            repl = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// How the CT entry of an instruction is found
+enum CT_INDEX_MODE {
+  CT_PC,      // the low CTsize bits of the address
+  CT_XOR,     // all the address bits, XOR folded down to CTsize
+  CT_GSHARE,  // the folded address XOR the outcomes of the last CTsize predictions
+  CT_TAGGED   // a PC indexed base table and two tagged tables indexed with 4 and 16 outcomes of history
+};
+
+static const std::string CT_INDEX_s[] = {"pc", "xor", "gshare", "tagged"};
+const UINT32 CT_INDEXES = sizeof(CT_INDEX_s)/sizeof(CT_INDEX_s[0]);
+
+// CT indexing mode called name, returns false if there is none
+inline bool parse_ct_index(const std::string& name, UINT32& mode){
+    for(UINT32 i = 0; i < CT_INDEXES; i++){
+        if(name == CT_INDEX_s[i]){
+            mode = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+#define CT_NONE 0xFFFFFFFF
+
+// XOR of all the bits-wide pieces of x
+inline UINT32 fold_bits(UINT64 x, UINT32 bits){
+    if(!bits){ return 0; }
+    UINT64 folded = 0;
+    for(; x; x >>= bits){ folded ^= x; }
+    return folded & ((1ULL << bits) - 1);
+}
+
+#define MAX_VPT_WAYS 16
+#define VPT_NO_TAG (~0ULL)  // tag of an empty way of an associative VPT, never an instruction address
+
+// Bits needed to tell n things apart
+inline UINT32 bits_to_count(UINT32 n){
+    UINT32 bits = 0;
+    while((1U << bits) < n){ bits++; }
+    return bits;
+}
+
+// Parameters of one simulated Value Prediction Unit, named after the knobs that set them
+class VPU_CONFIG {
+public:
+  UINT32 size;         // VPT size in bits
+  UINT32 CTsize;       // CT size in bits, 0 = perfect CT
+  UINT32 CTbits;       // CT counter width in bits
+  UINT32 HistDepth;    // value history depth
+  UINT32 VictimCache;  // victim cache entries
+  UINT32 PredType;     // VP_TYPE
+  UINT32 FCMorder;     // values hashed into the FCM context
+  UINT32 Fingerprint;  // 1 = keep 64 bit fingerprints of float values instead of the values
+  UINT32 VPTways;      // VPT associativity, 1 = direct mapped
+  UINT32 VPTrepl;      // VPT_REPL
+  UINT32 CTindex;      // CT_INDEX_MODE
+  UINT32 Stream;       // VP_STREAM
+};
+
+// Canonical "size=8,CTsize=8,..." form of a configuration.
+// The predictor type is only listed when it is not the default last value predictor.
+inline std::string config_string(const VPU_CONFIG& cfg){
+    std::ostringstream ss;
+    ss << "size=" << cfg.size << ",CTsize=" << cfg.CTsize << ",CTbits=" << cfg.CTbits
+       << ",HistDepth=" << cfg.HistDepth << ",VictimCache=" << cfg.VictimCache;
+    if(cfg.PredType != VP_LAST){ ss << ",PredType=" << VP_TYPE_s[cfg.PredType]; }
+    if(cfg.PredType == VP_FCM || cfg.PredType == VP_HYBRID){ ss << ",FCMorder=" << cfg.FCMorder; }
+    if(cfg.Fingerprint){ ss << ",Fingerprint=" << cfg.Fingerprint; }
+    if(cfg.VPTways != 1){ ss << ",VPTways=" << cfg.VPTways; }
+    if(cfg.VPTways != 1 && cfg.VPTrepl != REPL_LRU){ ss << ",VPTrepl=" << VPT_REPL_s[cfg.VPTrepl]; }
+    if(cfg.CTindex != CT_PC){ ss << ",CTindex=" << CT_INDEX_s[cfg.CTindex]; }
+    if(cfg.Stream != STREAM_REG){ ss << ",Stream=" << VP_STREAM_s[cfg.Stream]; }
+    return ss.str();
+}
+
+// Override fields of cfg from a comma or space separated list of knob=value pairs.
+// Returns false on an unknown knob or malformed pair.
+inline bool parse_config(const std::string& spec, VPU_CONFIG& cfg){
+    std::string token;
+    std::istringstream ss(spec);
+    while(ss >> token){
+        size_t start = 0;
+        while(start < token.size()){
+            size_t end = token.find(',', start);
+            if(end == std::string::npos){ end = token.size(); }
+            std::string pair = token.substr(start, end - start);
+            start = end + 1;
+            if(pair.empty()){ continue; }
+            size_t eq = pair.find('=');
+            if(eq == std::string::npos){ return false; }
+            std::string key = pair.substr(0, eq);
+            if(key == "PredType"){
+                if(!parse_pred_type(pair.substr(eq + 1), cfg.PredType)){ return false; }
+                continue;
+            }
+            if(key == "VPTrepl"){
+                if(!parse_vpt_repl(pair.substr(eq + 1), cfg.VPTrepl)){ return false; }
+                continue;
+            }
+            if(key == "CTindex"){
+                if(!parse_ct_index(pair.substr(eq + 1), cfg.CTindex)){ return false; }
+                continue;
+            }
+            if(key == "Stream"){
+                if(!parse_stream(pair.substr(eq + 1), cfg.Stream)){ return false; }
+                continue;
+            }
+            UINT32 value = strtoul(pair.c_str() + eq + 1, NULL, 0);
+            if(key == "size"){ cfg.size = value; }
+            else if(key == "CTsize"){ cfg.CTsize = value; }
+            else if(key == "CTbits"){ cfg.CTbits = value; }
+            else if(key == "HistDepth"){ cfg.HistDepth = value; }
+            else if(key == "VictimCache"){ cfg.VictimCache = value; }
+            else if(key == "FCMorder"){ cfg.FCMorder = value; }
+            else if(key == "Fingerprint"){ cfg.Fingerprint = value; }
+            else if(key == "VPTways"){ cfg.VPTways = value; }
+            else { return false; }
+        }
+    }
+    return true;
+}
+
+// Test and test-and-set spinlock on a byte, used by shared VPUs
+inline void spin_lock(volatile UINT8* lock){
+    while(__sync_lock_test_and_set(lock, 1)){
+        while(*lock){ _mm_pause(); }
+    }
+}
+
+inline void spin_unlock(volatile UINT8* lock){
+    __sync_lock_release(lock);
+}
+
+//Prediction statistics per instruction category.
+// Kept apart from the VPU so every thread can count into its own copy, even when sharing a VPU.
+class VPU_STATS {
+public:
+  UINT64 pred_success[CATEGORIES];  // Number of times the instruction is successfully predicted
+  UINT64 pred_failed[CATEGORIES];   // Number of times the entry is incorrectly predicted
+  UINT64 missed_success[CATEGORIES]; // Capture the number of correct predictions we missed
+
+  //Table activity, not split by category
+  UINT64 vpt_fills;     // VPT slots used for the first time
+  UINT64 vpt_misses;    // lookups whose tag was not in the VPT, each probes the victim cache
+  UINT64 vpt_evictions; // valid VPT entries pushed out to the victim cache
+  UINT64 vc_hits;       // VPT misses found in the victim cache
+  UINT64 ct_fills;      // CT slots used for the first time
+  UINT64 fp_matches;    // float values found in the history by fingerprint (Fingerprint=1)
+  UINT64 fp_false_matches; // of those, the ones whose check showed a different value
+  UINT64 ct_aliased;    // CT lookups whose entry was last updated by another instruction
+  UINT64 ct_alias_harm; // of those, the ones that ended in pred_failed or missed_success
+  UINT64 ct_tag_hits;   // CTindex=tagged: lookups served by a tagged table
+  UINT64 ct_allocs;     // CTindex=tagged: entries taken in a tagged table after a wrong confidence call
+
+  //Dataflow timing model (see DATAFLOW), both summed over the threads
+  UINT64 base_cycles;   // critical path length without value prediction
+  UINT64 vp_cycles;     // critical path length with this VPU's predictions
+#ifdef PROFILE
+  UINT64 cycles[PROF_PHASES]; // time spent in each phase
+#endif
+
+  VPU_STATS(){
+    for(UINT32 i = 0; i < CATEGORIES; i++){
+      pred_success[i] = 0;
+      pred_failed[i] = 0;
+      missed_success[i] = 0;
+    }
+    vpt_fills = 0;
+    vpt_misses = 0;
+    vpt_evictions = 0;
+    vc_hits = 0;
+    ct_fills = 0;
+    fp_matches = 0;
+    fp_false_matches = 0;
+    ct_aliased = 0;
+    ct_alias_harm = 0;
+    ct_tag_hits = 0;
+    ct_allocs = 0;
+    base_cycles = 0;
+    vp_cycles = 0;
+#ifdef PROFILE
+    memset(cycles, 0, sizeof(cycles));
+#endif
+  }
+
+  void add(const VPU_STATS& other){
+    for(UINT32 i = 0; i < CATEGORIES; i++){
+      pred_success[i] += other.pred_success[i];
+      pred_failed[i] += other.pred_failed[i];
+      missed_success[i] += other.missed_success[i];
+    }
+    vpt_fills += other.vpt_fills;
+    vpt_misses += other.vpt_misses;
+    vpt_evictions += other.vpt_evictions;
+    vc_hits += other.vc_hits;
+    ct_fills += other.ct_fills;
+    fp_matches += other.fp_matches;
+    fp_false_matches += other.fp_false_matches;
+    ct_aliased += other.ct_aliased;
+    ct_alias_harm += other.ct_alias_harm;
+    ct_tag_hits += other.ct_tag_hits;
+    ct_allocs += other.ct_allocs;
+    base_cycles += other.base_cycles;
+    vp_cycles += other.vp_cycles;
+#ifdef PROFILE
+    for(UINT32 i = 0; i < PROF_PHASES; i++){ cycles[i] += other.cycles[i]; }
+#endif
+  }
+
+  void subtract(const VPU_STATS& other){
+    for(UINT32 i = 0; i < CATEGORIES; i++){
+      pred_success[i] -= other.pred_success[i];
+      pred_failed[i] -= other.pred_failed[i];
+      missed_success[i] -= other.missed_success[i];
+    }
+    vpt_fills -= other.vpt_fills;
+    vpt_misses -= other.vpt_misses;
+    vpt_evictions -= other.vpt_evictions;
+    vc_hits -= other.vc_hits;
+    ct_fills -= other.ct_fills;
+    fp_matches -= other.fp_matches;
+    fp_false_matches -= other.fp_false_matches;
+    ct_aliased -= other.ct_aliased;
+    ct_alias_harm -= other.ct_alias_harm;
+    ct_tag_hits -= other.ct_tag_hits;
+    ct_allocs -= other.ct_allocs;
+    base_cycles -= other.base_cycles;
+    vp_cycles -= other.vp_cycles;
+#ifdef PROFILE
+    for(UINT32 i = 0; i < PROF_PHASES; i++){ cycles[i] -= other.cycles[i]; }
+#endif
+  }
+};
+
+// What VPU::predict did with a value
+// CT_MAX, CT_PRED_TH and CT_REP_TH of a CTbits wide counter. CTbits = 0 always predicts.
+// From Table 3 Lipasti
+inline constexpr UINT8 ct_max_of(UINT32 bits){ return bits ? (1 << bits) - 1 : 0; }
+inline constexpr UINT8 ct_pred_th_of(UINT32 bits){ return bits <= 1 ? bits : bits <= 3 ? 2 : 1 << (bits - 1); }
+inline constexpr UINT8 ct_rep_th_of(UINT32 bits){ return bits <= 1 ? bits : bits == 2 ? 3 : bits == 3 ? 5 : ct_max_of(bits); }
+
+// Predictor kernels: VPU::predict_kernel compiled for fixed values of the parameters that steer
+// its control flow (history depth, victim cache on or off, perfect CT, CT counter width), for the
+// configurations that are run most. They only cover direct mapped, PC indexed VPUs predicting the
+// last values without fingerprints. KERNEL_GENERIC reads everything from the VPU and runs any
+// configuration.
+enum VP_KERNEL_ID {
+  KERNEL_D1_CT1,      // the knob defaults
+  KERNEL_D1_CT2,
+  KERNEL_D1_CT1_VC,
+  KERNEL_D1_CT2_VC,
+  KERNEL_D1_PERFECT,
+  KERNEL_D4_CT2,
+  KERNEL_D4_CT2_VC,
+  KERNEL_GENERIC
+};
+
+class VP_KERNEL_PARAMS {
+public:
+  UINT32 depth;
+  bool vc;
+  bool perfect;
+  UINT32 ct_bits;
+};
+
+// The parameters of each kernel but KERNEL_GENERIC, indexed by VP_KERNEL_ID
+static constexpr VP_KERNEL_PARAMS VP_KERNELS[] = {
+  {1, false, false, 1}, {1, false, false, 2}, {1, true, false, 1}, {1, true, false, 2},
+  {1, false, true, 1}, {4, false, false, 2}, {4, true, false, 2}
+};
+static const std::string VP_KERNEL_s[] = {"d1_ct1", "d1_ct2", "d1_ct1_vc", "d1_ct2_vc", "d1_perfect", "d4_ct2", "d4_ct2_vc", "generic"};
+
+// The kernel that runs cfg
+inline UINT32 kernel_of(const VPU_CONFIG& cfg){
+    if(cfg.VPTways != 1 || cfg.PredType != VP_LAST || cfg.CTindex != CT_PC || cfg.Fingerprint){ return KERNEL_GENERIC; }
+    for(UINT32 k = 0; k < KERNEL_GENERIC; k++){
+        const VP_KERNEL_PARAMS& p = VP_KERNELS[k];
+        if(p.depth == cfg.HistDepth && p.vc == (cfg.VictimCache != 0) && p.perfect == (cfg.CTsize == 0)
+           && p.ct_bits == cfg.CTbits){
+            return k;
+        }
+    }
+    return KERNEL_GENERIC;
+}
+
+enum PREDICTION {
+  PRED_NONE,     // no prediction: a new entry, or a wrong value under the CT threshold
+  PRED_CORRECT,  // predicted the value (counted in pred_success)
+  PRED_WRONG,    // predicted a different value (counted in pred_failed)
+  PRED_MISSED    // the value was in the history but the CT held the prediction back (missed_success)
+};
+
+class VPU;
+typedef PREDICTION (*PREDICT_FUNPTR)(VPU* vpu, ADDRINT ins_ptr, const regval& value_to_write, RT datatype, INST_CAT flag, VPU_STATS& stats);
+inline PREDICT_FUNPTR kernel_funptr(UINT32 kernel);
+
+// One Value Prediction Unit: its VPT, CT and victim cache.
+// Every VPU sees the same stream of written values, so several configurations can be
+// evaluated side by side in one run.
+// A shared VPU may be driven by several threads at once. It then locks the VPT set, then the CT
+// slot (and the victim cache, only on a VPT miss) of each prediction, so threads working on
+// different instructions do not wait for each other.
+class VPU {
+public:
+  VPU_CONFIG config;
+  UINT8 VPT_BITS;      // Number of bits to use as VPT address
+  UINT32 VPT_ENTRIES;  // Length of VPT table
+  UINT32 VPT_MASK;     // Mask for VPT address table
+  UINT32 CT_ENTRIES;   // Length of Classification Table
+  UINT32 CT_MASK;       // Bitmask for Classification table entries
+  UINT8 CT_BITS;       // Size of prediction in bits
+  UINT8 CT_MAX;        // Size of prediction
+  UINT8 CT_PRED_TH;    // Threshold to use for prediction CT_Max/2
+  UINT8 CT_REP_TH;     // Threshold to replace value history
+  bool CT_PERF;        // CT is perfect - never fails
+  UINT32 VH_DEPTH;     // Value history depth, at most MAX_HIST_DEPTH
+  UINT8 PRED_TYPE;     // VP_TYPE of the int predictions
+  UINT8 FCM_ORDER;     // values hashed into the FCM context
+  UINT8 FCM_SHIFT;     // context bits each value is shifted by, so FCM_ORDER values fill VPT_BITS
+  bool FINGERPRINT;    // float values are kept as 64 bit fingerprints
+  UINT32 SLAB_BYTES;   // value history slab of every VPT and victim cache entry
+  UINT32 SLABS;        // one per VPT entry and victim cache node
+  UINT32 VPT_WAYS;     // entries per VPT set
+  UINT32 VPT_SETS;     // VPT_ENTRIES / VPT_WAYS
+  UINT32 SET_MASK;     // Bitmask for VPT sets
+  UINT8 VPT_REPL;      // replacement policy within a set
+
+  // Value Prediction Table (VPT_ENTRIES long). Set s is entries s * VPT_WAYS .. s * VPT_WAYS + VPT_WAYS - 1,
+  // picked by ins_ptr & SET_MASK, so with one way it is direct mapped on ins_ptr & VPT_MASK.
+  VPT_ENTRY* vpt;
+  // Associative VPT only: the tags of the entries again, VPT_NO_TAG if invalid, so a whole set is
+  // compared with a few SIMD instructions, and the replacement state of each set (VPT_SETS long):
+  // LRU keeps the way numbers of the set in 4 bit fields, most recently used lowest, PLRU the tree bits.
+  UINT64* vpt_tags;
+  UINT64* vpt_repl;
+  UINT64 repl_random;  // xorshift state of random replacement
+  // Value history slabs (SLABS * SLAB_BYTES long) and their float value blocks
+  UINT8* slabs;
+  WIDE_ARENA arena;
+  VIC_CACHE viccache;
+  // Classification Table (CT_ENTRIES long), indexed as CT_INDEX says. With CT_TAGGED the first
+  // half is the base table, then come two tagged tables of a quarter each.
+  CT_ENTRY* ct;
+  UINT8 CT_INDEX;      // CT_INDEX_MODE
+  UINT32 CT_SIZE;      // CT index bits
+  UINT8 STREAM;        // VP_STREAM, predict() is only handed the values of this stream
+  UINT64 ct_history;   // outcomes of the last CT lookups, 1 = the value was predictable, newest lowest
+  // Low 32 bits of the instruction that last updated each CT entry (CT_ENTRIES long). Not part of
+  // the modeled hardware, only there to count aliasing.
+  UINT32* ct_owner;
+  // FCM second level table, the value that last followed each context (VPT_ENTRIES long, FCM and hybrid only)
+  UINT64* fcm;
+
+  UINT32 KERNEL;            // VP_KERNEL_ID that predict() runs
+  PREDICT_FUNPTR kernel;
+
+  bool shared;             // take the locks below in predict()
+  volatile UINT8* vpt_locks; // one per VPT slot
+  volatile UINT8* ct_locks;  // one per CT slot
+  volatile UINT8 vc_lock;
+
+  // Without allocate the tables are left NULL, for load_snapshot to map them in
+  VPU(const VPU_CONFIG& cfg, bool allocate = true) : config(cfg) {
+    VPT_BITS = cfg.size;                    // Number of bits to use as VPT address
+    VPT_ENTRIES = POW(2, VPT_BITS);         // Length of VPT table
+    VPT_MASK = VPT_ENTRIES - 1;             // Mask for VPT address table
+    UINT8 ct_size = cfg.CTsize;             // CT table length, 0 = perfect
+    CT_PERF = !ct_size;
+    CT_ENTRIES = POW(2, ct_size); // Length of CT table
+    CT_MASK = CT_ENTRIES - 1;               // Mask for CT table
+    CT_BITS = cfg.CTbits;             // Size of prediction in bits
+    CT_INDEX = cfg.CTindex;
+    CT_SIZE = ct_size;
+    STREAM = cfg.Stream;
+    ct_history = 0;
+    CT_MAX = ct_max_of(CT_BITS);          // Size of prediction
+    CT_PRED_TH = ct_pred_th_of(CT_BITS);  // Threshold to use for prediction CT_Max/2
+    CT_REP_TH = ct_rep_th_of(CT_BITS);
+    VH_DEPTH = cfg.HistDepth;
+    KERNEL = kernel_of(cfg);
+    kernel = kernel_funptr(KERNEL);
+    PRED_TYPE = cfg.PredType;
+    FCM_ORDER = cfg.FCMorder;
+    FCM_SHIFT = (VPT_BITS + FCM_ORDER - 1) / FCM_ORDER;
+    if(!FCM_SHIFT){ FCM_SHIFT = 1; }
+    FINGERPRINT = cfg.Fingerprint;
+    SLAB_BYTES = vh_slab_bytes(VH_DEPTH, FINGERPRINT);
+    viccache.init(cfg.VictimCache);
+    SLABS = VPT_ENTRIES + viccache.capacity;
+    VPT_WAYS = cfg.VPTways;
+    VPT_SETS = VPT_ENTRIES / VPT_WAYS;
+    SET_MASK = VPT_SETS - 1;
+    VPT_REPL = cfg.VPTrepl;
+    repl_random = 0x9E3779B97F4A7C15ULL;
+    // Room for every slab to grow its float block through every width a value can have: 8 byte
+    // MMX, 16, 32 and MAX_BYTES_PER_PIN_REG byte slots. Checked by create_vpus.
+    if(!FINGERPRINT){ arena.init((UINT64) SLABS * VH_DEPTH * (8 + 16 + 32 + MAX_BYTES_PER_PIN_REG)); }
+
+    vpt = NULL;
+    ct = NULL;
+    slabs = NULL;
+    fcm = NULL;
+    vpt_tags = NULL;
+    vpt_repl = NULL;
+    ct_owner = NULL;
+    if(allocate){
+      vpt = new_aligned_table<VPT_ENTRY>(VPT_ENTRIES);
+      ct = new_aligned_table<CT_ENTRY>(CT_ENTRIES);
+      ct_owner = new_aligned_table<UINT32>(CT_ENTRIES);
+      memset(ct_owner, 0, CT_ENTRIES * sizeof(UINT32));
+      // Slab i belongs to VPT entry i, the rest to the victim cache nodes
+      slabs = new_vh_slabs(SLABS, SLAB_BYTES);
+      for(UINT32 i = 0; i < VPT_ENTRIES; i++){ vpt[i].slab = i; }
+      viccache.allocate(VPT_ENTRIES);
+      if(uses_fcm()){
+        fcm = new_aligned_table<UINT64>(VPT_ENTRIES);
+        memset(fcm, 0, VPT_ENTRIES * sizeof(UINT64));
+      }
+      if(VPT_WAYS > 1){
+        vpt_tags = new_aligned_table<UINT64>(VPT_ENTRIES);
+        vpt_repl = new_aligned_table<UINT64>(VPT_SETS);
+        clear_sets();
+      }
+    }
+
+    shared = false;
+    vpt_locks = NULL;
+    ct_locks = NULL;
+    vc_lock = 0;
+  }
+
+  // Allow predict() to be called from several threads at once
+  void make_shared(){
+    vpt_locks = new_aligned_table<UINT8>(VPT_SETS);
+    memset((UINT8*) vpt_locks, 0, VPT_SETS);
+    ct_locks = new_aligned_table<UINT8>(CT_ENTRIES);
+    memset((UINT8*) ct_locks, 0, CT_ENTRIES);
+    shared = true;
+  }
+
+  // Forget everything learned so far, as if the VPU had just been created.
+  // Value history slabs stay where they are, an entry with count 0 never matches.
+  void clear(){
+    for(UINT32 i = 0; i < VPT_ENTRIES; i++){
+      vpt[i].tag = 0;
+      vpt[i].valid = false;
+      vpt[i].count = 0;
+    }
+    for(UINT32 i = 0; i < CT_ENTRIES; i++){ ct[i] = CT_ENTRY(); }
+    memset(ct_owner, 0, CT_ENTRIES * sizeof(UINT32));
+    ct_history = 0;
+    viccache.clear();
+    if(fcm){ memset(fcm, 0, VPT_ENTRIES * sizeof(UINT64)); }
+    if(vpt_tags){ clear_sets(); }
+  }
+
+  // Empty every set of an associative VPT, ways in LRU order 0, 1, ...
+  void clear_sets(){
+    memset(vpt_tags, 0xFF, VPT_ENTRIES * sizeof(UINT64));
+    UINT64 order = 0;
+    for(UINT32 w = 0; w < VPT_WAYS; w++){ order |= (UINT64) w << (4 * w); }
+    for(UINT32 i = 0; i < VPT_SETS; i++){ vpt_repl[i] = (VPT_REPL == REPL_LRU) ? order : 0; }
+  }
+
+  // Mark way of set as the most recently used
+  void touch_way(UINT32 set, UINT32 way){
+    UINT64& r = vpt_repl[set];
+    if(VPT_REPL == REPL_LRU){
+      UINT32 pos = 0;
+      while(((r >> (4 * pos)) & 0xF) != way){ pos++; }
+      UINT64 below = r & ((1ULL << (4 * pos)) - 1);   // the ways used more recently
+      UINT64 above = (pos + 1 < 16) ? r & ~((1ULL << (4 * pos + 4)) - 1) : 0;
+      r = above | (below << 4) | way;
+    } else if(VPT_REPL == REPL_PLRU){
+      // point every node on the path to way away from it
+      UINT32 node = 1;
+      for(UINT32 half = VPT_WAYS >> 1; half; half >>= 1){
+        UINT32 right = (way & half) != 0;
+        if(right){ r &= ~(1ULL << node); } else { r |= 1ULL << node; }
+        node = 2 * node + right;
+      }
+    }
+  }
+
+  // Way of set to replace
+  UINT32 victim_way(UINT32 set){
+    UINT64 r = vpt_repl[set];
+    if(VPT_REPL == REPL_LRU){ return (r >> (4 * (VPT_WAYS - 1))) & 0xF; }
+    if(VPT_REPL == REPL_PLRU){
+      UINT32 node = 1;
+      UINT32 way = 0;
+      for(UINT32 half = VPT_WAYS >> 1; half; half >>= 1){
+        UINT32 right = (r >> node) & 1;
+        if(right){ way |= half; }
+        node = 2 * node + right;
+      }
+      return way;
+    }
+    repl_random ^= repl_random << 13;
+    repl_random ^= repl_random >> 7;
+    repl_random ^= repl_random << 17;
+    return repl_random & (VPT_WAYS - 1);
+  }
+
+  // VPT index of the entry for ins_ptr in set: the way holding it, else an empty way, else the
+  // way the replacement policy picks
+  UINT32 find_way(UINT32 set, ADDRINT ins_ptr){
+    const UINT64* tags = vpt_tags + set * VPT_WAYS;
+    UINT32 hits = match_words(tags, VPT_WAYS, ins_ptr);
+    if(!hits){ hits = match_words(tags, VPT_WAYS, VPT_NO_TAG); }
+    UINT32 way = hits ? __builtin_ctz(hits) : victim_way(set);
+    return set * VPT_WAYS + way;
+  }
+
+  // Bits a hardware VPU of this configuration would need, to compare configurations at equal
+  // area: VPT entries with a tag (48 bit addresses less the set index), HistDepth 64 bit values,
+  // their LRU order and the stride/context state, the replacement state of the sets, CT counters,
+  // victim cache entries with full tags, and the FCM table.
+  UINT64 storage_bits() const {
+    UINT64 history = (UINT64) VH_DEPTH * (64 + bits_to_count(VH_DEPTH));
+    UINT64 state = 0;
+    switch(PRED_TYPE){
+      case VP_STRIDE: state = 32; break;
+      case VP_2DELTA: state = 64; break;
+      case VP_FCM: state = 32; break;
+      case VP_HYBRID: state = 64 + 32 + 2; break;
+    }
+    UINT64 bits = (UINT64) VPT_ENTRIES * (1 + (48 - bits_to_count(VPT_SETS)) + history + state);
+    if(VPT_WAYS > 1 && VPT_REPL == REPL_LRU){ bits += (UINT64) VPT_ENTRIES * bits_to_count(VPT_WAYS); }
+    if(VPT_WAYS > 1 && VPT_REPL == REPL_PLRU){ bits += (UINT64) VPT_SETS * (VPT_WAYS - 1); }
+    if(!CT_PERF){ bits += (UINT64) CT_ENTRIES * CT_BITS; }
+    if(!CT_PERF && CT_INDEX == CT_GSHARE){ bits += CT_SIZE; }
+    if(!CT_PERF && CT_INDEX == CT_TAGGED){ bits += 16 + (UINT64) CT_ENTRIES / 2 * (1 + 8); } //history, valid bits and tags
+    bits += (UINT64) viccache.capacity * (1 + 48 + history + state);
+    if(uses_fcm()){ bits += (UINT64) VPT_ENTRIES * 64; }
+    return bits;
+  }
+
+  bool uses_fcm() const { return PRED_TYPE == VP_FCM || PRED_TYPE == VP_HYBRID; }
+
+  VH_SLAB slab_of(const VPT_ENTRY& e) const { return VH_SLAB(slabs + (UINT64) e.slab * SLAB_BYTES); }
+
+  // Bytes allocated for the tables of this VPU, including value history slabs, float value blocks
+  // and the victim cache
+  UINT64 memory_bytes() const {
+    UINT64 bytes = (UINT64) VPT_ENTRIES * sizeof(VPT_ENTRY) + (UINT64) SLABS * SLAB_BYTES + arena.used;
+    bytes += (UINT64) CT_ENTRIES * (sizeof(CT_ENTRY) + sizeof(UINT32));
+    bytes += viccache.memory_bytes();
+    if(uses_fcm()){ bytes += (UINT64) VPT_ENTRIES * sizeof(UINT64); }
+    if(VPT_WAYS > 1){ bytes += (UINT64) (VPT_ENTRIES + VPT_SETS) * sizeof(UINT64); }
+    if(shared){ bytes += VPT_SETS + CT_ENTRIES; }
+    return bytes;
+  }
+
+  // Add a value to the front of e's history, as its key or in the slab's float block.
+  // SPEC and DEPTH as in predict_kernel.
+  template<bool SPEC, UINT32 DEPTH>
+  void remember(VPT_ENTRY& e, const regval& v, RT datatype, UINT64 key, UINT32 check){
+    const bool fingerprint = !SPEC && FINGERPRINT;
+    UINT32 s = 0;
+    if(SPEC && DEPTH == 1){
+      e.count = 1;
+      e.order[0] = 0;
+    } else {
+      s = e.insert_slot(SPEC ? DEPTH : VH_DEPTH);
+    }
+    VH_SLAB slab = slab_of(e);
+    if(!IS_FLOAT(datatype) || fingerprint){
+      slab.keys()[s] = key;
+      if(fingerprint){ slab.checks(VH_DEPTH)[s] = check; }
+    } else {
+      slab.store_wide(s, v, VH_DEPTH, arena);
+    }
+  }
+
+  // Drop the fingerprint matches in hits whose check differs, counting them as false matches
+  UINT32 verify_fingerprints(const VPT_ENTRY& e, UINT32 hits, UINT32 check, VPU_STATS& stats){
+    const UINT32* checks = slab_of(e).checks(VH_DEPTH);
+    for(UINT32 h = hits; h; h &= h - 1){
+      UINT32 s = __builtin_ctz(h);
+      stats.fp_matches++;
+      if(checks[s] != check){
+        stats.fp_false_matches++;
+        hits &= ~(1 << s);
+      }
+    }
+    return hits;
+  }
+
+  // CT entry giving the confidence of ins_ptr. With CT_TAGGED that is the entry of the longest
+  // history table whose tag matches, else the base table's, and alloc is the entry of the next
+  // longer table (CT_NONE if there is none) with tag its tag for ins_ptr.
+  UINT32 ct_lookup(ADDRINT ins_ptr, UINT32& alloc, UINT8& tag) const {
+    alloc = CT_NONE;
+    switch(CT_INDEX){
+      case CT_PC: return ins_ptr & CT_MASK;
+      case CT_XOR: return fold_bits(ins_ptr, CT_SIZE);
+      case CT_GSHARE: return (fold_bits(ins_ptr, CT_SIZE) ^ ct_history) & CT_MASK;
+    }
+    UINT32 q = CT_SIZE - 2; //index bits of a tagged table
+    tag = (UINT8) ((ins_ptr * 0x9E3779B97F4A7C15ULL) >> 56);
+    UINT32 pc = fold_bits(ins_ptr, q);
+    UINT32 t1 = CT_ENTRIES / 2 + (pc ^ fold_bits(ct_history & 0xF, q));
+    UINT32 t2 = CT_ENTRIES / 4 * 3 + (pc ^ fold_bits(ct_history & 0xFFFF, q));
+    if(ct[t2].valid && ct[t2].tag == tag){ return t2; }
+    alloc = t2;
+    if(ct[t1].valid && ct[t1].tag == tag){ return t1; }
+    alloc = t1;
+    return fold_bits(ins_ptr, CT_SIZE - 1);
+  }
+
+  // Fold a value into the FCM context hash
+  UINT32 fcm_fold(UINT64 v) const {
+    return (UINT32) ((v * 0x9E3779B97F4A7C15ULL) >> 32);
+  }
+
+  // Check the int value v, masked to its register by mask, against the stride or context
+  // prediction of e, then train e with v. Strides wrap at the register's width, as the register
+  // does. Only used when PRED_TYPE is not VP_LAST. The FCM table is not locked in a shared VPU,
+  // a lost update only costs a prediction.
+  bool predict_int(VPT_ENTRY& e, UINT64 v, UINT64 mask){
+    UINT64 sign = (mask >> 1) + 1;
+    INT64 d = (INT64) ((((v - e.last) & mask) ^ sign) - sign); //sign extended from the register's width
+    INT32 d32 = (d == (INT32) d) ? (INT32) d : 0x7FFFFFFF; //too large to predict
+    bool stride_ok = ((e.last + (INT64) e.stride) & mask) == v;
+    bool fcm_ok = false;
+    if(fcm){
+      UINT64& slot = fcm[e.context & VPT_MASK];
+      fcm_ok = (slot == v);
+      slot = v;
+      e.context = (e.context << FCM_SHIFT) ^ fcm_fold(v);
+    }
+    bool correct;
+    switch(PRED_TYPE){
+      case VP_STRIDE:
+        correct = stride_ok;
+        e.stride = d32;
+        break;
+      case VP_2DELTA:
+        correct = stride_ok;
+        if(d32 == e.delta){ e.stride = d32; }
+        break;
+      case VP_FCM:
+        correct = fcm_ok;
+        break;
+      default: //VP_HYBRID
+        correct = (e.chooser >= 2) ? fcm_ok : stride_ok;
+        if(fcm_ok && !stride_ok && e.chooser < 3){ e.chooser++; }
+        if(stride_ok && !fcm_ok && e.chooser > 0){ e.chooser--; }
+        if(d32 == e.delta){ e.stride = d32; }
+    }
+    e.delta = d32;
+    e.last = v;
+    return correct;
+  }
+
+  template<bool SPEC, UINT32 DEPTH, bool VC, bool PERF, UINT32 CTBITS>
+  PREDICTION predict_kernel(ADDRINT ins_ptr, const regval& value_to_write, RT datatype, INST_CAT flag, VPU_STATS& stats);
+
+  // Run one dynamic value through this VPU: predict it from the tables, update its statistics and
+  // train the tables with it. Returns what the prediction was.
+  PREDICTION predict(ADDRINT ins_ptr, const regval& value_to_write, RT datatype, INST_CAT flag, VPU_STATS& stats){
+    return kernel(this, ins_ptr, value_to_write, datatype, flag, stats);
+  }
+};
+
+
+// The body of predict(). With SPEC the VPU runs kernel DEPTH, VC, PERF, CTBITS (see VP_KERNEL_ID)
+// and those decide every branch on the configuration at compile time, otherwise they are ignored
+// and the parameters are read from the VPU.
+template<bool SPEC, UINT32 DEPTH, bool VC, bool PERF, UINT32 CTBITS>
+inline PREDICTION VPU::predict_kernel(ADDRINT ins_ptr, const regval& value_to_write, RT datatype, INST_CAT flag, VPU_STATS& stats){
+    PROFILE_START(t);
+    const bool direct = SPEC || VPT_WAYS == 1;
+    const bool vc = SPEC ? VC : viccache.capacity != 0;
+    const bool perfect = SPEC ? PERF : CT_PERF;
+    const UINT8 ct_max = SPEC ? ct_max_of(CTBITS) : CT_MAX;
+    const UINT8 pred_th = SPEC ? ct_pred_th_of(CTBITS) : CT_PRED_TH;
+    const UINT8 rep_th = SPEC ? ct_rep_th_of(CTBITS) : CT_REP_TH;
+    const bool fingerprint = !SPEC && FINGERPRINT;
+    const bool last_values = SPEC || PRED_TYPE == VP_LAST;
+    const bool single = SPEC && DEPTH == 1;
+    PREDICTION prediction = PRED_NONE;
+    // Ints, and floats when fingerprinting, are looked up by a 64 bit key
+    bool keyed = !IS_FLOAT(datatype) || fingerprint;
+    UINT32 check = 0;
+    UINT64 key = value_to_write.value & INT_MASK[datatype];
+    if(IS_FLOAT(datatype)){ key = fingerprint ? value_fingerprint(value_to_write, value_to_write.bytes, check) : 0; }
+    UINT32 set = ins_ptr & SET_MASK;        // Calculate set in VPT
+    UINT32 ct_alloc = CT_NONE;
+    UINT8 ct_tag = 0;
+    UINT32 ct_index = SPEC ? ins_ptr & CT_MASK : ct_lookup(ins_ptr, ct_alloc, ct_tag); // Calculate index in CT
+
+    if(shared){ spin_lock(&vpt_locks[set]); }
+    UINT32 vpt_index = direct ? set : find_way(set, ins_ptr);
+    VPT_ENTRY& vpt_entry = vpt[vpt_index];
+    CT_ENTRY& ct_entry = ct[ct_index];
+
+    bool vpt_miss = !vpt_entry.valid || ins_ptr != vpt_entry.tag;
+    bool vic_cache_hit = false; 
+    if(vpt_miss){
+        stats.vpt_misses++;
+        bool lock_vc = shared && vc;
+        if(lock_vc){ spin_lock(&vc_lock); }
+        //If there's a collision in the VPT, then evict it into the victim cache
+        if(!vpt_entry.valid){
+            stats.vpt_fills++;
+        } else {
+            stats.vpt_evictions++;
+            if(vc){ vpt_entry.slab = viccache.insert(vpt_entry); }
+            vpt_entry.count = 0;
+            vpt_entry.valid = false;
+        }
+        //check whether the victim cache has it, and if so move it into the VPT
+        if(vc){ vic_cache_hit = viccache.take(ins_ptr, vpt_entry); }
+        if(vic_cache_hit){ stats.vc_hits++; }
+        if(lock_vc){ spin_unlock(&vc_lock); }
+        if(!direct){ vpt_tags[vpt_index] = ins_ptr; }
+    }
+    if(!direct){ touch_way(set, vpt_index & (VPT_WAYS - 1)); }
+
+    // Create VPT entry if it doesn't exist. It only holds the value being predicted, so this call
+    // is a cold miss and makes no prediction.
+    bool allocated = vpt_miss && !vic_cache_hit;
+    if(allocated){
+      #ifdef PRINTF
+      std::cout << "IP: " << ins_ptr << " --> " << (vpt_index) << std::endl;
+      #endif
+      vpt_entry.valid = true;
+      vpt_entry.tag = ins_ptr;
+      remember<SPEC, DEPTH>(vpt_entry, value_to_write, datatype, key, check);  // put write value as first VPT 
+      vpt_entry.reset_state(value_to_write.value & INT_MASK[datatype]);
+    }
+    PROFILE_LAP(t, stats.cycles, PROF_VPT_LOOKUP);
+
+    if(shared){ spin_lock(&ct_locks[ct_index]); }
+    if(!ct_entry.valid){
+      stats.ct_fills++;
+      ct_entry.valid = true;
+      ct_entry.counter = 0;
+      ct_owner[ct_index] = (UINT32) ins_ptr;
+      // no prediction yet, but keep the stride and context state current
+      if(!last_values && !IS_FLOAT(datatype)){ predict_int(vpt_entry, value_to_write.value & INT_MASK[datatype], INT_MASK[datatype]); }
+      PROFILE_LAP(t, stats.cycles, PROF_CT_UPDATE);
+    }
+    else if(allocated){
+      //nothing to predict from, and the CT is left as it is
+    }
+    else {
+      #ifdef PRINTF
+      std::cout << "IP: " << ins_ptr << " [" << (ct_index) << "]" << std::endl;
+      // need to calculate if above threshold
+      std::cout << "Old val(s): "; 
+      for(UINT32 i = 0; i < vpt_entry.count; i++){
+        std::cout << slab_of(vpt_entry).get(vpt_entry.order[i], datatype, FINGERPRINT, arena) << ", ";
+      }
+      std::cout << std::endl;
+      std::cout << "New val: " << value_to_write << std::endl;
+      #endif
+
+      VH_SLAB slab = slab_of(vpt_entry);
+      UINT32 vh_hits;
+      if(single && keyed){ vh_hits = vpt_entry.count && slab.keys()[0] == key; }
+      else { vh_hits = keyed ? slab.match_key(key, vpt_entry.count) : slab.match_wide(value_to_write, vpt_entry.count, arena); }
+      if(vh_hits && IS_FLOAT(datatype) && fingerprint){ vh_hits = verify_fingerprints(vpt_entry, vh_hits, check, stats); }
+      bool correct = vh_hits != 0;
+      if(!last_values && !IS_FLOAT(datatype)){ correct = predict_int(vpt_entry, value_to_write.value & INT_MASK[datatype], INT_MASK[datatype]); }
+      PROFILE_LAP(t, stats.cycles, PROF_VPT_LOOKUP);
+      if(correct) {
+        #ifdef PRINTF
+        std::cout << "SUCCESS" << std::endl;
+        #endif
+        // If it's passed the threshold make prediction
+        if(perfect || (ct_entry.counter >= pred_th)) {
+          stats.pred_success[flag]++;
+          prediction = PRED_CORRECT;
+        }
+        else {
+          stats.missed_success[flag]++;
+          prediction = PRED_MISSED;
+        }
+        // Increment prediction history
+        if(ct_entry.counter < ct_max) { ct_entry.counter++; }
+      }
+      else {
+        #ifdef PRINTF
+        std::cout << "FAIL" << std::endl;
+        #endif
+        // If it's passed the threshold make (wrong) prediction
+        if(!perfect && (ct_entry.counter >= pred_th)) {
+          stats.pred_failed[flag]++;
+          prediction = PRED_WRONG;
+        }
+        // Decrement prediction history
+        if(ct_entry.counter > 0) { ct_entry.counter--; }
+      }
+      bool aliased = ct_owner[ct_index] != (UINT32) ins_ptr;
+      bool wrong_call = prediction == PRED_WRONG || prediction == PRED_MISSED;
+      stats.ct_aliased += aliased;
+      stats.ct_alias_harm += aliased && wrong_call;
+      ct_owner[ct_index] = (UINT32) ins_ptr;
+      ct_history = (ct_history << 1) | correct;
+      if(!SPEC && CT_INDEX == CT_TAGGED){
+        stats.ct_tag_hits += ct_index >= CT_ENTRIES / 2;
+        // A wrong call gets this instruction an entry with more history, starting at the threshold
+        // if the value was predictable and at 0 if not. Not locked, a lost update only costs a prediction.
+        if(wrong_call && ct_alloc != CT_NONE){
+          stats.ct_allocs++;
+          CT_ENTRY& a = ct[ct_alloc];
+          a.valid = true;
+          a.tag = ct_tag;
+          a.counter = correct ? pred_th : 0;
+          ct_owner[ct_alloc] = (UINT32) ins_ptr;
+        }
+      }
+      PROFILE_LAP(t, stats.cycles, PROF_CT_UPDATE);
+      // Update actual VPT unless we are over the replacement threshold
+      if(!(ct_entry.counter >= rep_th)) {
+
+        //if we found an value we used before, just move it to the front (to keep track of LRU) 
+        if(vh_hits){
+            if(!single){ vpt_entry.touch(__builtin_ctz(vh_hits)); }
+        }else{
+            //add a new value to our value history (evicting the lru if full)
+            remember<SPEC, DEPTH>(vpt_entry, value_to_write, datatype, key, check);
+        }
+      }
+      PROFILE_LAP(t, stats.cycles, PROF_HISTORY);
+      #ifdef PRINTF
+      std::cout << "Updated Value History: "; 
+      for(UINT32 i = 0; i < vpt_entry.count; i++){
+        std::cout << slab_of(vpt_entry).get(vpt_entry.order[i], datatype, FINGERPRINT, arena) << ", ";
+      }
+      std::cout << std::endl;
+      #endif  
+    }
+    if(shared){
+      spin_unlock(&ct_locks[ct_index]);
+      spin_unlock(&vpt_locks[set]);
+    }
+    return prediction;
+}
+
+// Kernel K of VP_KERNEL_ID, as a plain function for VPU::kernel and for callers that inline it
+template<UINT32 K>
+class VP_KERNEL {
+public:
+  static const UINT32 P = K < KERNEL_GENERIC ? K : 0; //the parameters, ignored by KERNEL_GENERIC
+  static PREDICTION predict(VPU* vpu, ADDRINT ins_ptr, const regval& value_to_write, RT datatype, INST_CAT flag, VPU_STATS& stats){
+    return vpu->predict_kernel<K != KERNEL_GENERIC, VP_KERNELS[P].depth, VP_KERNELS[P].vc, VP_KERNELS[P].perfect,
+                               VP_KERNELS[P].ct_bits>(ins_ptr, value_to_write, datatype, flag, stats);
+  }
+};
+
+inline PREDICT_FUNPTR kernel_funptr(UINT32 kernel){
+    switch(kernel){
+      case KERNEL_D1_CT1: return VP_KERNEL<KERNEL_D1_CT1>::predict;
+      case KERNEL_D1_CT2: return VP_KERNEL<KERNEL_D1_CT2>::predict;
+      case KERNEL_D1_CT1_VC: return VP_KERNEL<KERNEL_D1_CT1_VC>::predict;
+      case KERNEL_D1_CT2_VC: return VP_KERNEL<KERNEL_D1_CT2_VC>::predict;
+      case KERNEL_D1_PERFECT: return VP_KERNEL<KERNEL_D1_PERFECT>::predict;
+      case KERNEL_D4_CT2: return VP_KERNEL<KERNEL_D4_CT2>::predict;
+      case KERNEL_D4_CT2_VC: return VP_KERNEL<KERNEL_D4_CT2_VC>::predict;
+    }
+    return VP_KERNEL<KERNEL_GENERIC>::predict;
+}
+
+#define DF_REGS 512     // registers a DATAFLOW tracks, numbered densely by the caller
+#define DF_MAX_SRCS 8   // source registers of one instruction that are tracked
+
+// Dataflow limit timing of one thread's instructions, after Lipasti's "Exceeding the Dataflow Limit".
+// Every register has the cycle its value is ready. An instruction issues once its sources are
+// ready and once its fetch slot has come (width instructions per cycle, 0 = unlimited), and
+// takes one cycle. A correctly predicted value is ready for its consumers when the instruction is
+// fetched. Consumers of a wrongly predicted value wait for it to complete plus the recovery penalty.
+class DATAFLOW {
+public:
+  UINT64 ready[DF_REGS];
+  UINT64 fetched;   // instructions timed so far
+  UINT64 critical;  // last cycle anything completed or became ready, the critical path length
+
+  DATAFLOW() : fetched(0), critical(0) { memset(ready, 0, sizeof(ready)); }
+
+  // Time one instruction reading srcs and writing dst whose value was predicted as given.
+  // Returns how many cycles it added to the critical path.
+  UINT64 step(const UINT16* srcs, UINT32 num_srcs, UINT16 dst, PREDICTION prediction, UINT32 width, UINT32 penalty){
+    UINT64 fetch = width ? fetched / width : 0;
+    fetched++;
+    UINT64 issue = fetch;
+    for(UINT32 i = 0; i < num_srcs; i++){
+      if(ready[srcs[i]] > issue){ issue = ready[srcs[i]]; }
+    }
+    UINT64 complete = issue + 1;
+    UINT64 done = complete;
+    if(prediction == PRED_CORRECT){
+      ready[dst] = fetch;
+    } else if(prediction == PRED_WRONG){
+      ready[dst] = done = complete + penalty;
+    } else {
+      ready[dst] = complete;
+    }
+    if(done <= critical){ return 0; }
+    UINT64 added = done - critical;
+    critical = done;
+    return added;
+  }
+};
+
+// Append the configurations listed in a file, one per line with # comments, to specs
+inline bool read_config_file(const std::string& path, std::vector<std::string>& specs){
+    std::ifstream config_file(path.c_str());
+    if(!config_file){ return false; }
+    std::string line;
+    while(std::getline(config_file, line)){
+        line = line.substr(0, line.find('#'));  //strip comments
+        if(line.find_first_not_of(" \t\r") != std::string::npos){ specs.push_back(line); }
+    }
+    return true;
+}
+
+// Create one VPU per configuration spec, each starting from base. With no specs, simulate base.
+// Returns an error message, empty on success.
+// Without allocate the VPUs are left without tables, for load_snapshot to map them in.
+inline std::string create_vpus(const VPU_CONFIG& base, std::vector<std::string> specs, std::vector<VPU*>& vpus, bool allocate = true){
+    if(specs.empty()){ specs.push_back(""); }
+    for(UINT32 i = 0; i < specs.size(); i++){
+        VPU_CONFIG cfg = base;
+        if(!parse_config(specs[i], cfg)){
+            return "Bad VPU configuration: " + specs[i];
+        }
+        if(cfg.HistDepth < 1 || cfg.HistDepth > MAX_HIST_DEPTH){
+            std::ostringstream error;
+            error << "HistDepth must be between 1 and " << MAX_HIST_DEPTH;
+            return error.str();
+        }
+        if(cfg.Fingerprint > 1){
+            return "Fingerprint must be 0 or 1";
+        }
+        if(cfg.CTindex == CT_TAGGED && cfg.CTsize < 3){
+            return "CTindex=tagged needs CTsize of at least 3";
+        }
+        if(cfg.VPTways < 1 || cfg.VPTways > MAX_VPT_WAYS || (cfg.VPTways & (cfg.VPTways - 1)) || cfg.VPTways > (1U << cfg.size)){
+            std::ostringstream error;
+            error << "VPTways must be a power of 2 between 1 and " << MAX_VPT_WAYS << ", and at most the VPT size";
+            return error.str();
+        }
+        if(cfg.FCMorder < 1 || cfg.FCMorder > MAX_FCM_ORDER){
+            std::ostringstream error;
+            error << "FCMorder must be between 1 and " << MAX_FCM_ORDER;
+            return error.str();
+        }
+        VPU* vpu = new VPU(cfg, allocate);
+        if(!cfg.Fingerprint && !vpu->arena.base){
+            delete vpu;
+            return "Cannot reserve the float value arena of " + config_string(cfg);
+        }
+        vpus.push_back(vpu);
+    }
+    return "";
+}
+
+// Write the LOCALITY DATA and VPT SETTINGS blocks of every VPU, with stats[v] the statistics of vpus[v].
+// Value locality does not depend on the configuration, so it is passed in per category. A block
+// only lists the categories of the stream its VPU predicts.
+inline void print_vpu_results(std::ostream& out, const std::vector<VPU*>& vpus, const std::vector<VPU_STATS>& stats,
+                              const UINT64 prev_per_category[], const UINT64 hit_per_category[]){
+    using std::endl;
+    //One block per simulated configuration
+    for(UINT32 v = 0; v < vpus.size(); v++){
+        VPU* vpu = vpus[v];
+        const VPU_STATS& vpu_stats = stats[v];
+        if(vpus.size() > 1){
+            out << endl << "============== CONFIG " << v << " ==============" << endl;
+            out << "CONFIG" << "|" << config_string(vpu->config) << endl;
+        }
+
+        //Aggregates the locality and prediction statistics of the categories this VPU sees
+        //(category 0 is UNKNOWN and not counted)
+        UINT64 total_prev = 0;
+        UINT64 total_hit_count = 0;
+        UINT64 total_success = 0;
+        UINT64 total_fail = 0;
+        UINT64 total_missed_success = 0;
+        for(UINT32 i = 1; i < CATEGORIES; i++){
+            if(stream_of(i) != vpu->STREAM){ continue; }
+            total_prev += prev_per_category[i];
+            total_hit_count += hit_per_category[i];
+            total_success += vpu_stats.pred_success[i];
+            total_fail += vpu_stats.pred_failed[i];
+            total_missed_success += vpu_stats.missed_success[i];
+        }
+
+        out << endl << "============== LOCALITY DATA =============" << endl;
+        out << "OPERATION" << "|" << "LOCALITY_COUNT" << "|" << "TOTAL_COUNT" << "|" << "SUCCESS_COUNT" << "|" << "FAIL_COUNT" << "|" << "MISSED_SUCCESS" << endl;
+        out << "Total|" << total_prev << "|" << total_hit_count << "|" << total_success << "|" << total_fail << "|" << total_missed_success << endl;
+        for(short i = 0; i < CATEGORIES; i++) {
+          if(stream_of(i) != vpu->STREAM){ continue; }
+          //UNKNOWN instructions are not reported, same as in the locality columns
+          UINT64 success = i ? vpu_stats.pred_success[i] : 0;
+          UINT64 fail = i ? vpu_stats.pred_failed[i] : 0;
+          UINT64 missed_success = i ? vpu_stats.missed_success[i] : 0;
+          out << INST_CAT_s[i] << "|" << prev_per_category[i] << "|" << hit_per_category[i] << "|" << success << "|" << fail << "|" << missed_success <<endl;
+        }
+
+        //Only the pintool knows the registers each instruction reads, the replay simulator has no timing
+        if(vpu_stats.vp_cycles){
+          out << endl << "============== DATAFLOW TIMING ==============" << endl;
+          out << "BASE_CYCLES" << "|" << vpu_stats.base_cycles << endl;
+          out << "VP_CYCLES" << "|" << vpu_stats.vp_cycles << endl;
+          out << "SPEEDUP" << "|" << (double) vpu_stats.base_cycles / vpu_stats.vp_cycles << endl;
+        }
+
+        out << endl << "============== VPT SETTINGS ==============" << endl;
+        out << "STREAM" << "|" << VP_STREAM_s[vpu->STREAM] << endl;
+        out << "VPT_BITS" << "|" << (UINT32)vpu->VPT_BITS << endl;
+        out << "VPT_ENTRIES" << "|" << (UINT32)vpu->VPT_ENTRIES << endl;
+        out << "VPT_WAYS" << "|" << vpu->VPT_WAYS << endl;
+        if(vpu->VPT_WAYS > 1){ out << "VPT_REPL" << "|" << VPT_REPL_s[vpu->VPT_REPL] << endl; }
+        //lookups are the values this configuration saw, the same as the locality total
+        out << "VPT_HIT_RATE" << "|" << (total_hit_count ? 1 - (double) vpu_stats.vpt_misses / total_hit_count : 0) << endl;
+        out << "VPT_EVICTIONS" << "|" << vpu_stats.vpt_evictions << endl;
+        out << "STORAGE_BITS" << "|" << vpu->storage_bits() << endl;
+        out << "VH_DEPTH" << "|" << (UINT32)vpu->VH_DEPTH << endl;
+        out << "CT_ENTRIES" << "|" << (UINT32)vpu->CT_ENTRIES << endl;
+        out << "CT_PERF" << "|" << (bool)vpu->CT_PERF << endl;
+        out << "CT_PRED_TH" << "|" << (UINT32)vpu->CT_PRED_TH << endl;
+        out << "CT_REP_TH" << "|" << (UINT32)vpu->CT_REP_TH << endl;
+        out << "CT_BITS" << "|" << (UINT32)vpu->CT_BITS << endl;
+        out << "CT_INDEX" << "|" << CT_INDEX_s[vpu->CT_INDEX] << endl;
+        out << "CT_ALIASED" << "|" << vpu_stats.ct_aliased << endl;
+        out << "CT_ALIAS_HARM" << "|" << vpu_stats.ct_alias_harm << endl;
+        if(vpu->CT_INDEX == CT_TAGGED){
+          out << "CT_TAG_HITS" << "|" << vpu_stats.ct_tag_hits << endl;
+          out << "CT_ALLOCS" << "|" << vpu_stats.ct_allocs << endl;
+        }
+        out << "VC_ENTRIES" << "|" << (UINT32)vpu->viccache.capacity << endl;
+        out << "PRED_TYPE" << "|" << VP_TYPE_s[vpu->PRED_TYPE] << endl;
+        out << "KERNEL" << "|" << VP_KERNEL_s[vpu->KERNEL] << endl;
+        out << "TABLE_BYTES" << "|" << vpu->memory_bytes() << endl;
+        if(vpu->FINGERPRINT){
+          out << "FP_MATCHES" << "|" << vpu_stats.fp_matches << endl;
+          out << "FP_FALSE_MATCHES" << "|" << vpu_stats.fp_false_matches << endl;
+          out << "FP_FALSE_MATCH_RATE" << "|" << (vpu_stats.fp_matches ? (double) vpu_stats.fp_false_matches / vpu_stats.fp_matches : 0) << endl;
+        }
+        if(vpu->uses_fcm()){ out << "FCM_ORDER" << "|" << (UINT32)vpu->FCM_ORDER << endl; }
+
+        out << endl << endl;
+    }
+}
+
+#endif // VPU_H
@@ -0,0 +1,174 @@
+// Microbenchmark for the Value Prediction Unit core: drives VPU::predict with synthetic value
+// streams, without Pin or a target program, and reports the time per prediction and the memory
+// used by each configuration. Meant for catching hot path regressions in vpu.h on any Linux box.
+#include <chrono>
+#include "vpu.h"
+
+using std::cerr;
+using std::cout;
+using std::string;
+using std::endl;
+
+// One dynamic value, as the pintool would hand it to the VPU
+struct BENCH_VALUE {
+    ADDRINT ins_ptr;
+    regval value;
+    INST_CAT flag;
+};
+
+struct BENCH_STREAM {
+    string name;
+    RT datatype;
+    std::vector<BENCH_VALUE> values;
+};
+
+// xorshift64, so every run sees the same streams
+static UINT64 rng_state = 0x9E3779B97F4A7C15ULL;
+static inline UINT64 next_random(){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Static instructions the int streams cycle through, spaced like real code
+static const UINT32 BENCH_PCS = 1024;
+static inline ADDRINT bench_pc(UINT64 i){ return 0x400000 + (i % BENCH_PCS) * 4; }
+
+static const char* STREAM_NAMES[] = {"constant", "strided", "random", "aliasing", "wide_float"};
+static const UINT32 STREAMS = sizeof(STREAM_NAMES)/sizeof(STREAM_NAMES[0]);
+
+// Fill stream with n values of one synthetic stream kind, up front so generating the values is
+// not part of the timing. Only one stream is kept in memory at a time, float values are large.
+static void make_stream(UINT32 kind, UINT64 n, BENCH_STREAM& stream){
+    stream.name = STREAM_NAMES[kind];
+    stream.datatype = i64reg;
+    stream.values.resize(n);
+    std::vector<regval> pool;
+    const UINT32 pool_size = 4;
+    if(stream.name == "wide_float"){
+        stream.datatype = freg;
+        pool.resize(BENCH_PCS * pool_size);
+        for(UINT32 p = 0; p < pool.size(); p++){
+            UINT64 words[MAX_BYTES_PER_PIN_REG / 8];
+            for(UINT32 w = 0; w < MAX_BYTES_PER_PIN_REG / 8; w++){ words[w] = next_random(); }
+            pool[p].set_float(words, MAX_BYTES_PER_PIN_REG);
+        }
+    }
+    for(UINT64 i = 0; i < n; i++){
+        BENCH_VALUE& v = stream.values[i];
+        v.ins_ptr = bench_pc(i);
+        switch(kind){
+            case 0: //Every instruction writes the same value each time
+                v.value = regval((UINT64) (i % BENCH_PCS) * 0x1000, i64reg);
+                v.flag = I_PURE_LOAD;
+                break;
+            case 1: //Every instruction walks an array, the value grows by a fixed stride per execution
+                v.value = regval((i / BENCH_PCS) * 8 + (i % BENCH_PCS) * 0x100000, i64reg);
+                v.flag = I_PURE_ARITH;
+                break;
+            case 2: //No value locality at all
+                v.value = regval(next_random(), i64reg);
+                v.flag = I_LOAD_ARITH;
+                break;
+            case 3: //Constant values, but the PCs only differ above bit 16 so they fight over the same VPT and CT entries
+                v.ins_ptr = (ADDRINT) (i % BENCH_PCS) << 16;
+                v.value = regval((UINT64) (i % BENCH_PCS) * 0x1000, i64reg);
+                v.flag = I_PURE_LOAD;
+                break;
+            default: //Full width vector registers, each instruction picks one of a few values
+                v.value = pool[(i % BENCH_PCS) * pool_size + next_random() % pool_size];
+                v.flag = F_PURE_LOAD;
+        }
+    }
+}
+
+static int Usage()
+{
+    cerr << "This program times the value prediction unit on synthetic value streams\n";
+    cerr << "usage: vpubench [-n VALUES] [-config SPEC]... [-config_file FILE]\n"
+         << "Without -config a sweep over size, HistDepth and VictimCache is run.\n";
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    UINT64 n = 1000000;
+    string config_file;
+    std::vector<string> specs;
+
+    for(int i = 1; i < argc; i += 2){
+        if(i + 1 >= argc){ return Usage(); }
+        string knob = argv[i];
+        string value = argv[i + 1];
+        if(knob == "-n"){ n = strtoull(value.c_str(), NULL, 0); }
+        else if(knob == "-config"){ specs.push_back(value); }
+        else if(knob == "-config_file"){ config_file = value; }
+        else { return Usage(); }
+    }
+    if(!n){ return Usage(); }
+    if(!config_file.empty() && !read_config_file(config_file, specs)){
+        cerr << "Cannot open config file " << config_file << endl;
+        return Usage();
+    }
+
+    //Default sweep over the knobs that change the table sizes and the per value work
+    if(specs.empty()){
+        const char* sizes[] = {"8", "12", "16"};
+        const char* depths[] = {"1", "4", "16"};
+        const char* victims[] = {"0", "64"};
+        for(UINT32 s = 0; s < 3; s++)
+            for(UINT32 d = 0; d < 3; d++)
+                for(UINT32 v = 0; v < 2; v++)
+                    specs.push_back(string("size=") + sizes[s] + ",CTsize=" + sizes[s] + ",CTbits=2,HistDepth=" + depths[d] + ",VictimCache=" + victims[v]);
+    }
+
+    VPU_CONFIG knob_config;
+    knob_config.size = 8;
+    knob_config.CTsize = 8;
+    knob_config.CTbits = 1;
+    knob_config.HistDepth = 1;
+    knob_config.VictimCache = 0;
+    knob_config.PredType = VP_LAST;
+    knob_config.FCMorder = 2;
+    knob_config.Fingerprint = 0;
+    knob_config.VPTways = 1;
+    knob_config.VPTrepl = REPL_LRU;
+    knob_config.CTindex = CT_PC;
+    knob_config.Stream = STREAM_REG;
+    std::vector<VPU*> vpus;
+    string error = create_vpus(knob_config, specs, vpus);
+    if(!error.empty()){
+        cerr << error << endl;
+        return Usage();
+    }
+
+    cout << "============== VPU BENCHMARK ==============" << endl;
+    cout << "Values per stream| " << n << endl;
+    cout << "STREAM|CONFIG|NS_PER_PREDICTION|BYTES_PER_ENTRY|TOTAL_BYTES|SUCCESS_RATE" << endl;
+    BENCH_STREAM stream;
+    for(UINT32 s = 0; s < STREAMS; s++){
+        make_stream(s, n, stream);
+        for(UINT32 c = 0; c < vpus.size(); c++){
+            VPU* vpu = vpus[c];
+            //Every run starts from empty tables
+            vpu->clear();
+            VPU_STATS stats;
+            UINT64 correct = 0;
+
+            auto start = std::chrono::steady_clock::now();
+            for(UINT64 i = 0; i < n; i++){
+                const BENCH_VALUE& v = stream.values[i];
+                correct += vpu->predict(v.ins_ptr, v.value, stream.datatype, v.flag, stats) == PRED_CORRECT;
+            }
+            auto stop = std::chrono::steady_clock::now();
+
+            double ns = std::chrono::duration<double, std::nano>(stop - start).count() / n;
+            UINT64 bytes = vpu->memory_bytes();
+            cout << stream.name << "|" << config_string(vpu->config) << "|" << std::fixed << std::setprecision(2) << ns
+                 << "|" << std::setprecision(1) << (double) bytes / vpu->VPT_ENTRIES << "|" << bytes
+                 << "|" << std::setprecision(4) << (double) correct / n << endl;
+        }
+    }
+    return 0;
+}
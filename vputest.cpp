@@ -0,0 +1,80 @@
+// Checks of the Value Prediction Unit core that need neither Pin nor a target program: each one
+// drives VPU::predict with a short, hand made value sequence and looks at what it returns.
+// Run by `make vputest.test`, prints the checks that fail and exits non zero if any does.
+#include "vpu.h"
+
+using std::cerr;
+using std::cout;
+using std::string;
+using std::endl;
+
+// A VPU of spec over the default last value configuration, NULL (with error set) if it is invalid
+static VPU* make_vpu(const string& spec, string& error){
+    VPU_CONFIG base;
+    base.size = 8;
+    base.CTsize = 8;
+    base.CTbits = 1;
+    base.HistDepth = 1;
+    base.VictimCache = 0;
+    base.PredType = VP_LAST;
+    base.FCMorder = 2;
+    base.Fingerprint = 0;
+    base.VPTways = 1;
+    base.VPTrepl = REPL_LRU;
+    base.CTindex = CT_PC;
+    base.Stream = STREAM_REG;
+    std::vector<VPU*> vpus;
+    error = create_vpus(base, std::vector<string>(1, spec), vpus);
+    return error.empty() ? vpus[0] : NULL;
+}
+
+// A float register of bytes bytes, every byte set to fill
+static regval float_value(UINT32 bytes, UINT8 fill){
+    UINT8 raw[MAX_BYTES_PER_PIN_REG];
+    memset(raw, fill, bytes);
+    regval v;
+    v.set_float(raw, bytes);
+    return v;
+}
+
+// A narrow float value, then a wider one at the same instruction moves its history to a wider
+// block. The narrow value must move with it, and the rest of the new block must not match zero.
+static string check_wide_history(){
+    string error;
+    VPU* vpu = make_vpu("CTsize=0,HistDepth=4", error);
+    if(!vpu){ return error; }
+    VPU_STATS stats;
+    const ADDRINT pc = 0x400000;
+    vpu->predict(pc, float_value(16, 0x11), freg, F_PURE_ARITH, stats);
+    vpu->predict(pc, float_value(MAX_BYTES_PER_PIN_REG, 0x22), freg, F_PURE_ARITH, stats);
+    if(vpu->predict(pc, float_value(MAX_BYTES_PER_PIN_REG, 0), freg, F_PURE_ARITH, stats) == PRED_CORRECT){
+        return "a zero float value matched history slots that were never written";
+    }
+    if(vpu->predict(pc, float_value(16, 0x11), freg, F_PURE_ARITH, stats) != PRED_CORRECT){
+        return "a float value was lost when its history moved to a wider block";
+    }
+    return "";
+}
+
+struct CHECK {
+    const char* name;
+    string (*run)();
+};
+
+static const CHECK CHECKS[] = {
+    {"wide_history", check_wide_history},
+};
+
+int main(int argc, char *argv[])
+{
+    UINT32 failed = 0;
+    for(UINT32 c = 0; c < sizeof(CHECKS)/sizeof(CHECKS[0]); c++){
+        string error = CHECKS[c].run();
+        if(!error.empty()){
+            cerr << CHECKS[c].name << ": " << error << endl;
+            failed++;
+        }
+    }
+    cout << "VPU checks failed| " << failed << endl;
+    return failed ? 1 : 0;
+}